@@ -4,57 +4,123 @@
 */
 #include <iostream>
 #include <vector>
-#include <stack>
+#include <map>
+#include <list>
+#include <algorithm>
 #include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL2_gfxPrimitives.h>
+#include <SDL2/SDL2_framerate.h>
+#include <SDL2/SDL2_rotozoom.h>
 
 #include "LSystem.h"
 #include "matrix.h"
 //#include "colourRGB.h"
 #include "transformed_renderer.h"
+#include "parallel.h"
+#include "turtle.h"
 
 using namespace std;
 
 static const int DEFAULT_SIZE_X = 800;
 static const int DEFAULT_SIZE_Y = 600;
+//The most frames drawn per second (more input in that time is coalesced into one frame)
+static const int FRAME_RATE = 60;
+//How long frame_loop waits for an event at a time
+static const int IDLE_TIMEOUT_MS = 100;
+//How long one slice of a progressively drawn frame may take (leaving the
+//rest of the frame time for events and presenting)
+static const double FRAME_BUDGET_MS = 12;
+//In forest mode, trees are drawn with up to this many fewer iterations than LS_iterations
+static const int FOREST_SPREAD = 2;
+//While idle, the iteration counts next to LS_iterations are built ahead
+//of time as long as the caches (with the one to build) stay under this,
+//and the counts farthest from it are dropped to keep them under it
+static const double SPECULATION_BUDGET_MB = 256;
+//How much bigger one more iteration is assumed to be when there is only one smaller count to go by
+static const double SPECULATION_GROWTH = 4;
+//The most finished frames kept (as textures the size of the window)
+static const int FRAME_CACHE_SIZE = 8;
+//How long after the last zoom or resize the scaled preview is replaced by a full draw
+static const int SETTLE_MS = 150;
 
 
 class A3Canvas{
 public:
-    float *leaf_vx,*leaf_vy;
-    static const unsigned int leaf_verts = 8;
     int WINDOW_SIZE_X, WINDOW_SIZE_Y;
     
-	A3Canvas(LSystem* L){
+	A3Canvas(LSystem* L, const TurtleInterpreter& turtle): tr(NULL), turtle(turtle){
         WINDOW_SIZE_X = DEFAULT_SIZE_X;
         WINDOW_SIZE_Y = DEFAULT_SIZE_Y;
-		float vx[] = {0,1.0 ,1.25,   1,  0,  -1,-1.25,-1};
-		float vy[] = {0,0.75,1.75,2.75,4.0,2.75, 1.75,0.75};
 		LS_iterations = 0;
 		this->L_system = L;
-        leaf_vx = new float[8];
-        leaf_vy = new float[8];
-        for(int i=0;i<8;i++){
-            leaf_vx[i] = vx[i];
-            leaf_vy[i] = vy[i];
-        }
+        //The shapes are set by the grammar file (or the interpreter's defaults)
+        vector<float> vx, vy;
+        turtle.GetShape(TURTLE_LEAF, vx, vy);
+        leaf_shape = tr.add_shape(&vx[0], &vy[0], vx.size());
+        turtle.GetShape(TURTLE_STEM, vx, vy);
+        stem_shape = tr.add_shape(&vx[0], &vy[0], vx.size());
+        turtle.Compile(*L, program);
         num_trees = 1;
+        zoom = 1;
+        culling = true;
+        lod_pixels = 1;
+        auto_fit = true;
+        instancing = true;
+        peephole = true;
+        threads = 0;
+        forest = false;
+        forest_seed = 1;
+        progressive = true;
+        profiling = false;
+        frame_pending = false;
+        frame_target = frame_shown = -1;
+        frame_clock = 0;
+        settling = false;
+        worker_quit = false;
+        generation = 0;
+        worker = thread(&A3Canvas::worker_main, this);
+	}
+	~A3Canvas(){
+		{
+			lock_guard<mutex> lock(worker_mutex);
+			worker_quit = true;
+			generation++;
+		}
+		worker_wake.notify_one();
+		worker.join();
+		for(unsigned int i=0; i<frame_cache.size(); i++)
+			SDL_DestroyTexture(frame_cache[i].texture);
 	}
 
 	
 	void frame_loop(SDL_Renderer* r, SDL_Window* w){
+		//Frames are paced to at most FRAME_RATE per second; input that
+		//arrives while a frame is drawn (or while waiting for the next one)
+		//is handled all at once, and only the final state is drawn
+		FPSmanager fps;
+		SDL_initFramerate(&fps);
+		SDL_setFramerate(&fps, FRAME_RATE);
 		unsigned int last_frame = SDL_GetTicks();
-		//unsigned int frame_number = 0;
-		draw(r,0);
+		if(draw(r,0))
+			SDL_framerateDelay(&fps);
 		while(1){
-			//cout << "Frame " << frame_number << endl;
-			unsigned int current_frame = SDL_GetTicks();
-			unsigned int delta_ms = current_frame - last_frame;
-			
 			SDL_Event e;
+			//Sleep until there is an event (rather than spinning), or until
+			//a scaled preview is due to be replaced, unless a frame is partly
+			//drawn, in which case only check for one
+			int timeout = IDLE_TIMEOUT_MS;
+			if(settling)
+				timeout = max(0, min(timeout, (int)(settle_time - SDL_GetTicks())));
+			bool event = frame_pending? SDL_PollEvent(&e): SDL_WaitEventTimeout(&e, timeout);
+			if(!event && !frame_pending && !settling)
+				speculate();
+			bool redraw = false;
 			//Handle all queued events
-			while(SDL_PollEvent(&e)){
+			if(event) do{
 				switch(e.type){
 					case SDL_QUIT:
 						//Exit immediately
@@ -62,27 +128,166 @@ public:
 					case SDL_KEYDOWN:
 						//e.key stores the key pressed
 						handle_key_down(e.key.keysym.sym);
-						draw(r,delta_ms);
+						redraw = true;
+						break;
+					case SDL_USEREVENT:
+						//The worker has finished building some geometry (which
+						//is only drawn if it was asked for, not speculative)
+						if(collect_jobs())
+							redraw = true;
 						break;
                     case SDL_WINDOWEVENT:
                         if(resized(e.window)){
                             SDL_RenderPresent(r);
-                            draw(r,delta_ms);
+                            redraw = true;
                         }
                         break;
+					case SDL_RENDER_TARGETS_RESET:
+					case SDL_RENDER_DEVICE_RESET:
+						//The cached frames have been lost
+						forget_frames(e.type == SDL_RENDER_DEVICE_RESET);
+						redraw = true;
+						break;
 					default:
 						break;
 				}
-			}
-			
-			
-			
+			}while(SDL_PollEvent(&e));
+			//(New input abandons a partly drawn frame)
+			bool presented = false;
+			bool settled = settling && (int)(SDL_GetTicks() - settle_time) >= 0;
+			if(redraw || settled){
+				unsigned int current_frame = SDL_GetTicks();
+				presented = draw(r,current_frame - last_frame, !settled);
+				last_frame = current_frame;
+			}else if(frame_pending)
+				presented = draw_slice(r);
+			if(presented)
+				SDL_framerateDelay(&fps);
 		}
 		
 	}
 private:
 	int LS_iterations, num_trees;
+	double zoom; //Magnification about the centre of the window
+	bool culling; //Skip branches which are entirely off-screen
+	float lod_pixels; //Branches smaller than this on screen are drawn as one pixel (0 to disable)
+	bool auto_fit; //Scale the trees to fit the window (rather than a fixed scale)
+	bool instancing; //Draw from the instanced geometry (rather than the interpreted string)
+	bool peephole; //Simplify the generated actions before interpreting them
+	int threads; //Threads interpreting the generated actions and placing the forest (0 for one per hardware thread)
+	bool forest; //Draw num_trees trees scattered in rows (see place_forest)
+	unsigned int forest_seed; //The seed of every tree in the forest comes from this
+	bool progressive; //Draw frames in time slices (see draw_slice), with a preview while the geometry is built
+	bool profiling; //Print timings, and the rule profile with each generation (each Job has its own copy)
+	//The geometry for one of the iteration counts drawn in the frame
+	struct TreeModel{
+		int iterations; //(Fewer than asked for in a preview)
+		const TurtleInstances* instances; //(NULL if the geometry is used)
+		const TurtleGeometry* geometry;
+		TurtleBounds bounds;
+		unsigned long primitives, leaves;
+	};
+	vector<TreeModel> tree_models; //Indexed by LS_iterations minus the count (see get_tree_models)
+	//A tree placed for the current frame
+	struct PlacedTree{
+		enum{ CULLED, IMPOSTOR, DRAWN } state;
+		int model; //Index in tree_models
+		Affine2d root;
+		TurtleBounds box; //On screen
+	};
+	vector<PlacedTree> placed_trees; //Set by place_forest; each slice of a progressive frame reads it
+	unsigned long forest_culled, forest_impostors; //Trees, for the profile output
+	//Where drawing the current frame got to, so the next slice can resume
+	//there: the tree, and within it the next primitive and branch record
+	//(interpreted geometry) or the stack of instances being drawn
+	struct InstanceFrame{
+		int instance;
+		unsigned int item; //The next item to draw
+		Affine2d transform;
+	};
+	bool frame_pending; //A frame is partly drawn
+	unsigned int next_tree;
+	bool tree_started;
+	unsigned int next_primitive, next_branch;
+	vector<InstanceFrame> instance_stack;
+	unsigned long slice_primitives; //Primitives drawn in the current slice
+	double frame_primitives, frame_ms; //In the current frame's trees, and the time spent drawing it so far
+	int frame_slices;
+	//Frames are drawn into render target textures and kept, so a scene
+	//drawn before (after UP then DOWN, say) is presented again with one
+	//blit. Anything which changes the picture is part of the Scene.
+	struct Scene{
+		int iterations, num_trees;
+		int width, height; //Of the renderer's output
+		double zoom;
+		bool forest;
+		unsigned int forest_seed;
+		bool auto_fit, instancing, peephole, culling;
+		float lod_pixels;
+		int backend;
+		bool batching;
+		//True if the two differ in the zoom and window size only
+		bool same_but_view(const Scene& s) const{
+			return iterations == s.iterations && num_trees == s.num_trees && forest == s.forest
+				&& forest_seed == s.forest_seed && auto_fit == s.auto_fit && instancing == s.instancing
+				&& peephole == s.peephole && culling == s.culling && lod_pixels == s.lod_pixels
+				&& backend == s.backend && batching == s.batching;
+		}
+		bool operator==(const Scene& s) const{
+			return same_but_view(s) && width == s.width && height == s.height && zoom == s.zoom;
+		}
+	};
+	struct CachedFrame{
+		Scene scene;
+		SDL_Texture* texture;
+		bool complete; //Drawn in full, with the exact geometry (not a preview)
+		unsigned int used; //The value of frame_clock when it was last presented
+	};
+	vector<CachedFrame> frame_cache; //(Up to FRAME_CACHE_SIZE)
+	int frame_target; //The frame being drawn (-1 if drawing straight to the window)
+	int frame_shown; //The last complete frame presented (-1 if none)
+	unsigned int frame_clock; //Counts the frames presented
+	bool frame_exact; //The frame being drawn isn't a preview
+	//After a zoom or resize the last frame is scaled to fit (see
+	//draw_scaled), and drawn properly at settle_time if no more input comes
+	bool settling;
+	unsigned int settle_time;
+	//Counts for the profile output (reset each frame)
+	unsigned long culled_branches, culled_primitives, lod_branches, lod_primitives;
 	LSystem* L_system;
+	TransformedRenderer tr;
+	int leaf_shape, stem_shape;
+	TurtleInterpreter turtle;
+	TurtleProgram program; //The rules, compiled by the turtle
+	vector<TurtleAction> generated; //The worker's generated actions (only the geometry built from them is cached)
+	map<int, TurtleGeometry> geometry_cache; //Indexed by iteration count
+	map<int, TurtleInstances> instance_cache; //Indexed by iteration count (root is -1 if the rules can't be instanced)
+	//The geometry is built on a worker thread, one job at a time, so the
+	//window stays responsive (and the last frame stays up) meanwhile
+	struct Job{
+		enum{ NONE, INSTANCES, GEOMETRY };
+		int type;
+		int iterations;
+		bool peephole, profiling;
+		int threads;
+		bool speculative; //Built while idle in case it is needed next (see speculate)
+		unsigned int token; //The value of generation the job was requested with
+		Job(): type(NONE), speculative(false){ }
+	};
+	thread worker;
+	mutex worker_mutex; //Guards the jobs and the finished geometry
+	condition_variable worker_wake;
+	bool worker_quit;
+	Job requested, running; //The job to start next and the one being done (type NONE if none)
+	atomic<unsigned int> generation; //Incremented to cancel the running job (see TurtleCancel)
+	//The jobs finished (and not cancelled) since collect_jobs last ran, and
+	//what they built
+	struct FinishedJob{
+		Job job;
+		TurtleGeometry geometry;
+		TurtleInstances instances;
+	};
+	list<FinishedJob> finished;
 	void handle_key_down(SDL_Keycode key){
 		if (key == SDLK_UP){
 			LS_iterations++;
@@ -92,12 +297,88 @@ private:
 				LS_iterations = 0;
 		}
         else if(key == SDLK_RIGHT){
-            num_trees++;
+            //(A forest grows and shrinks by doubling, to reach thousands of trees)
+            if(forest)
+                num_trees = min(num_trees*2, 1 << 20);
+            else
+                num_trees++;
         }
         else if(key == SDLK_LEFT){
-            num_trees--;
+            if(forest)
+                num_trees /= 2;
+            else
+                num_trees--;
             if(num_trees < 1)   num_trees = 1;
         }
+        else if(key == SDLK_n){
+            //Toggle forest mode
+            forest = !forest;
+        }
+        else if(key == SDLK_g){
+            //Grow a different forest
+            forest_seed++;
+        }
+        else if(key == SDLK_v){
+            //Toggle progressive (time sliced) drawing
+            progressive = !progressive;
+        }
+        else if(key == SDLK_EQUALS){
+            zoom *= 1.25;
+        }
+        else if(key == SDLK_MINUS){
+            zoom /= 1.25;
+        }
+        else if(key == SDLK_0){
+            zoom = 1;
+        }
+        else if(key == SDLK_f){
+            //Toggle fitting the trees to the window
+            auto_fit = !auto_fit;
+        }
+        else if(key == SDLK_i){
+            //Toggle drawing from instances
+            instancing = !instancing;
+        }
+        else if(key == SDLK_o){
+            //Toggle the peephole pass (the geometry is regenerated with or without it)
+            peephole = !peephole;
+            geometry_cache.clear();
+        }
+        else if(key == SDLK_m){
+            //Toggle interpreting the generated actions on every thread or on one
+            //(the geometry is the same either way, so the cache is kept)
+            threads = threads == 1? 0: 1;
+        }
+        else if(key == SDLK_c){
+            //Toggle branch culling
+            culling = !culling;
+        }
+        else if(key == SDLK_l){
+            //Cycle the level of detail threshold through 1, 2, 4 and 8 pixels and off
+            if(lod_pixels == 0)
+                lod_pixels = 1;
+            else if(lod_pixels < 8)
+                lod_pixels *= 2;
+            else
+                lod_pixels = 0;
+        }
+        else if(key == SDLK_b){
+            //Toggle batched drawing (one SDL_RenderGeometry call per frame)
+            tr.set_batching(!tr.is_batching());
+        }
+        else if(key == SDLK_r){
+            //Cycle through the backends: SDL_gfx, software rasterizer, tiled (multithreaded) software rasterizer
+            if(tr.get_backend() == TransformedRenderer::BACKEND_SDL)
+                tr.set_backend(TransformedRenderer::BACKEND_SOFTWARE);
+            else if(tr.get_backend() == TransformedRenderer::BACKEND_SOFTWARE)
+                tr.set_backend(TransformedRenderer::BACKEND_TILED);
+            else
+                tr.set_backend(TransformedRenderer::BACKEND_SDL);
+        }
+        else if(key == SDLK_p){
+            //Toggle the rule profiler (the table is printed after each generation)
+            profiling = !profiling;
+        }
 	}
     bool resized(SDL_WindowEvent e){
         if(e.event == SDL_WINDOWEVENT_SIZE_CHANGED){
@@ -109,116 +390,889 @@ private:
     }
 	
 	
-	inline Matrix3 Rotation(float radians){
-		Matrix3 M;
-		M.identity();
-		M(0,0) = M(1,1) = cos(radians);
-		M(1,0) = -(M(0,1) = sin(radians));
-		return M;
+	void draw_leaf(TransformedRenderer& tr){
+		tr.fillShape(leaf_shape, 64,224,0, 255);
+		tr.drawShape(leaf_shape, 64,128,0, 255);
+	}
+    void draw_stem(TransformedRenderer& tr){
+        tr.fillShape(stem_shape, 178,106,45,255);
+    }
+    void draw_primitive(TransformedRenderer& tr, int type){
+        switch(type){
+            case TURTLE_LEAF:
+                draw_leaf(tr);
+                break;
+            case TURTLE_STEM:
+                draw_stem(tr);
+                break;
+            default:
+                break;
+        }
+    }
+    //Stand-in for a branch too small to draw (box is its screen bounds): a
+    //single pixel in the leaf and stem colours, weighted by how many of each it has
+    void draw_impostor(TransformedRenderer& tr, unsigned long leaves, unsigned long primitives, const TurtleBounds& box){
+        float f = leaves/(float)primitives;
+        tr.set_transform(Affine2());
+        tr.drawPoint((box.x0 + box.x1)/2, (box.y0 + box.y1)/2,
+            64*f + 178*(1 - f), 224*f + 106*(1 - f), 45*(1 - f), 255);
+    }
+
+
+
+	//Print the rule profile for the job's iteration count (on the worker
+	//thread, for jobs of either type). Returns false if the job was cancelled.
+	bool print_rule_profile(const Job& job, const TurtleCancel& cancel){
+		//(The rule profile comes from generating the string itself; only
+		//the worker does that, so the LSystem's counters are its own)
+		string ls_string = L_system->GenerateSystemString(job.iterations, true, &cancel);
+		if (cancel.cancelled()){
+			printf("Rule profile for %d iterations cancelled\n", job.iterations);
+			return false;
+		}
+		printf("Rule profile for %d iterations (%u symbols):\n", job.iterations, (unsigned int)ls_string.size());
+		L_system->PrintProfile(stdout);
+		return true;
+	}
+
+	//Generate and interpret the compiled rules for the job's iteration
+	//count (on the worker thread). Returns false if the job was cancelled.
+	bool build_geometry(const Job& job, TurtleGeometry& geometry, const TurtleCancel& cancel){
+		if (job.profiling && !print_rule_profile(job, cancel))
+			return false;
+		Uint64 interp_start = SDL_GetPerformanceCounter();
+		if (!turtle.Generate(program, job.iterations, generated, &cancel)){
+			if (job.profiling)
+				printf("Generation for %d iterations cancelled\n", job.iterations);
+			return false;
+		}
+		TurtlePeepholeStats stats;
+		if (job.peephole)
+			stats = TurtleInterpreter::Optimize(generated);
+		if (!turtle.Interpret(generated, geometry, job.threads, &cancel)){
+			if (job.profiling)
+				printf("Interpretation for %d iterations cancelled\n", job.iterations);
+			return false;
+		}
+		if (job.profiling){
+			if (job.peephole)
+				printf("Peephole pass removed %lu of %lu actions (%.1f%%): %lu merged, %lu cancelled, %lu dead moves, %lu empty branches\n",
+					stats.before - stats.after, stats.before,
+					stats.before > 0? 100.0*(stats.before - stats.after)/stats.before: 0.0,
+					stats.merged, stats.cancelled, stats.dead, stats.empty_branches);
+			double ms = (SDL_GetPerformanceCounter() - interp_start)*1000.0/SDL_GetPerformanceFrequency();
+			printf("Generated and interpreted %lu actions into %u primitives in %.2f ms (%.1f ns/action, %s)\n",
+				geometry.symbols, (unsigned int)geometry.primitives.size(), ms,
+				geometry.symbols > 0? ms*1e6/geometry.symbols: 0.0,
+				job.threads == 1? "one thread": "all threads");
+		}
+		return true;
 	}
-	inline Matrix3 Translation(float tx, float ty){
-		Matrix3 M;
-		M.identity();
-		M(0,2) = tx;
-		M(1,2) = ty;
-		return M;
+
+	//Build the instanced geometry for the job's iteration count from the
+	//rules (on the worker thread). The root is -1 if the rules can't be
+	//instanced. Returns false if the job was cancelled.
+	bool build_instances(const Job& job, TurtleInstances& instances, const TurtleCancel& cancel){
+		if (job.profiling && !print_rule_profile(job, cancel))
+			return false;
+		Uint64 start = SDL_GetPerformanceCounter();
+		bool instanced = turtle.Instance(program, job.iterations, instances, &cancel);
+		if (cancel.cancelled()){
+			if (job.profiling)
+				printf("Instancing for %d iterations cancelled\n", job.iterations);
+			return false;
+		}
+		if (job.profiling){
+			double ms = (SDL_GetPerformanceCounter() - start)*1000.0/SDL_GetPerformanceFrequency();
+			if (instanced){
+				unsigned long items = 0;
+				for (unsigned int i = 0; i < instances.instances.size(); i++)
+					items += instances.instances[i].items.size();
+				printf("Built %u instances (%lu items) for %lu primitives in %.2f ms\n",
+					(unsigned int)instances.instances.size(), items,
+					instances.instances[instances.root].primitives, ms);
+			}else
+				printf("The rules can't be instanced (unbalanced brackets); interpreting the string instead\n");
+		}
+		return true;
 	}
-	inline Matrix3 Scale(float sx, float sy){
-		Matrix3 M;
-		M.identity();
-		M(0,0) = sx;
-		M(1,1) = sy;
-		return M;
+
+	void worker_main(){
+		TurtleGeometry geometry;
+		TurtleInstances instances;
+		unique_lock<mutex> lock(worker_mutex);
+		while(1){
+			while(!worker_quit && requested.type == Job::NONE)
+				worker_wake.wait(lock);
+			if(worker_quit)
+				return;
+			Job job = running = requested;
+			requested.type = Job::NONE;
+			lock.unlock();
+			TurtleCancel cancel(generation, job.token);
+			bool done;
+			if(job.type == Job::INSTANCES)
+				done = build_instances(job, instances, cancel);
+			else
+				done = build_geometry(job, geometry, cancel);
+			lock.lock();
+			if(done && !cancel.cancelled()){
+				//(After any earlier job which hasn't been collected yet: that
+				//one wasn't cancelled, so it is still wanted)
+				finished.push_back(FinishedJob());
+				finished.back().job = running; //(Which may have been asked for since it started)
+				if(job.type == Job::INSTANCES)
+					swap(finished.back().instances, instances);
+				else
+					swap(finished.back().geometry, geometry);
+				//Wake frame_loop to draw with it
+				SDL_Event e;
+				SDL_zero(e);
+				e.type = SDL_USEREVENT;
+				SDL_PushEvent(&e);
+			}
+			running.type = Job::NONE;
+		}
 	}
 
+	//True if the two jobs would build the same thing
+	bool same_job(const Job& a, const Job& b){
+		return a.type == b.type && a.iterations == b.iterations
+			&& (a.type != Job::GEOMETRY || a.peephole == b.peephole);
+	}
 
-	void draw_leaf(TransformedRenderer& tr){
-		tr.fillPolygon(leaf_vx,leaf_vy,leaf_verts, 64,224,0, 255);
-		tr.drawPolygon(leaf_vx,leaf_vy,leaf_verts, 64,128,0, 255);
+	//Ask the worker to build something (cancelling anything else it is
+	//doing), unless it is already building it. If it is building it
+	//speculatively, it is kept and drawn when done. A speculative job runs
+	//on one thread, leaving the others to the drawing; one that is asked
+	//for before it starts gets all of them back, but one already running
+	//finishes on its one thread (rather than starting over).
+	void request(int type, int iterations, bool speculative = false){
+		Job job;
+		job.type = type;
+		job.iterations = iterations;
+		job.peephole = peephole;
+		job.profiling = profiling && !speculative;
+		job.threads = speculative? 1: threads;
+		job.speculative = speculative;
+		lock_guard<mutex> lock(worker_mutex);
+		if(running.type != Job::NONE && running.token == generation && same_job(running, job)){
+			running.speculative = running.speculative && speculative;
+			return;
+		}
+		if(requested.type != Job::NONE && same_job(requested, job)){
+			if(!speculative)
+				requested.threads = threads;
+			requested.speculative = requested.speculative && speculative;
+			return;
+		}
+		job.token = ++generation;
+		requested = job;
+		worker_wake.notify_one();
 	}
-    void draw_stem(TransformedRenderer& tr){
-        tr.fillRectangle(-0.5,0,0.5,6,178,106,45,255);
-    }
 
+	//Cancel whatever the worker is doing (nothing it builds is needed now)
+	void cancel_jobs(){
+		lock_guard<mutex> lock(worker_mutex);
+		if(running.type != Job::NONE || requested.type != Job::NONE){
+			generation++;
+			requested.type = Job::NONE;
+		}
+	}
 
+	//Move the jobs the worker has finished into the caches. Returns true if
+	//any of them was asked for (rather than speculative), and so should be drawn.
+	bool collect_jobs(){
+		lock_guard<mutex> lock(worker_mutex);
+		bool asked_for = false;
+		for(list<FinishedJob>::iterator it = finished.begin(); it != finished.end(); it++){
+			const Job& job = it->job;
+			if(job.type == Job::GEOMETRY && job.peephole == peephole)
+				swap(geometry_cache[job.iterations], it->geometry);
+			else if(job.type == Job::INSTANCES)
+				swap(instance_cache[job.iterations], it->instances);
+			else
+				continue;
+			asked_for = asked_for || !job.speculative;
+		}
+		finished.clear();
+		return asked_for;
+	}
 
-	void draw(SDL_Renderer *renderer, float frame_delta_ms){
-	    stack<Matrix3> t_stack;
+	//The memory held by cached geometry (or instances)
+	static double cached_bytes(const TurtleGeometry& geometry){
+		return geometry.primitives.capacity()*sizeof(TurtlePrimitive) + geometry.branches.capacity()*sizeof(TurtleBranch);
+	}
+	static double cached_bytes(const TurtleInstances& instances){
+		double bytes = instances.instances.capacity()*sizeof(TurtleInstance);
+		for(unsigned int i=0; i<instances.instances.size(); i++)
+			bytes += instances.instances[i].items.capacity()*sizeof(TurtleInstanceItem);
+		return bytes;
+	}
+	template<class T> static double cached_bytes(const map<int, T>& cache){
+		double bytes = 0;
+		for(typename map<int, T>::const_iterator it = cache.begin(); it != cache.end(); it++)
+			bytes += cached_bytes(it->second);
+		return bytes;
+	}
+	//Estimate the memory the given iteration count will take in the cache,
+	//from the largest smaller count in it (or else the smallest larger one,
+	//since smaller counts may have been dropped), assuming each iteration
+	//grows by the same factor as the one next to that count did (0 if there
+	//is nothing to go by)
+	template<class T> static double estimate_bytes(const map<int, T>& cache, int iterations){
+		typename map<int, T>::const_iterator it = cache.lower_bound(iterations), next;
+		if(it == cache.end() && it == cache.begin())
+			return 0;
+		if(it != cache.begin())
+			it--;
+		next = it;
+		next++;
+		double bytes = cached_bytes(it->second), growth = SPECULATION_GROWTH;
+		if(it != cache.begin()){
+			typename map<int, T>::const_iterator before = it;
+			before--;
+			double before_bytes = cached_bytes(before->second);
+			if(before->first == it->first - 1 && before_bytes > 0)
+				growth = max(1.0, bytes/before_bytes);
+		}else if(next != cache.end() && next->first == it->first + 1 && bytes > 0)
+			growth = max(1.0, cached_bytes(next->second)/bytes);
+		return bytes*pow(growth, iterations - it->first);
+	}
+	//Drop cached iteration counts (from both caches), farthest from
+	//LS_iterations first and the larger of two as far, until the caches take
+	//at most budget bytes. Only counts at least min_distance away, and not
+	//drawn (LS_iterations, or the FOREST_SPREAD counts below it in a forest),
+	//are dropped, and if all_or_nothing, none are unless that is enough.
+	//(This only runs between frames, so no frame is left pointing at a
+	//dropped count.) Returns the bytes still cached.
+	double evict_models(double budget, int min_distance, bool all_or_nothing = false){
+		int spread = forest? FOREST_SPREAD: 0;
+		map<int, double> count_bytes;
+		for(map<int, TurtleGeometry>::iterator it = geometry_cache.begin(); it != geometry_cache.end(); it++)
+			count_bytes[it->first] += cached_bytes(it->second);
+		for(map<int, TurtleInstances>::iterator it = instance_cache.begin(); it != instance_cache.end(); it++)
+			count_bytes[it->first] += cached_bytes(it->second);
+		double bytes = 0, droppable = 0;
+		vector<pair<int, int> > order; //(Distance, count), the first to drop last
+		for(map<int, double>::iterator it = count_bytes.begin(); it != count_bytes.end(); it++){
+			bytes += it->second;
+			int distance = abs(it->first - LS_iterations);
+			bool drawn = it->first <= LS_iterations && it->first >= LS_iterations - spread;
+			if(distance >= min_distance && !drawn){
+				order.push_back(make_pair(distance, it->first));
+				droppable += it->second;
+			}
+		}
+		if(bytes <= budget || (all_or_nothing && bytes - droppable > budget))
+			return bytes;
+		sort(order.begin(), order.end());
+		while(bytes > budget && !order.empty()){
+			int iterations = order.back().second;
+			order.pop_back();
+			bytes -= count_bytes[iterations];
+			geometry_cache.erase(iterations);
+			instance_cache.erase(iterations);
+			if(profiling)
+				printf("Dropped %d iterations from the cache (%.1f MB)\n", iterations, count_bytes[iterations]/1048576);
+		}
+		return bytes;
+	}
 
-		//float frame_delta_seconds = frame_delta_ms/1000.0;
+	//While idle, ask the worker to build the iteration count after
+	//LS_iterations (or else the one before) if it isn't cached, so that
+	//pressing UP or DOWN next draws at once. The caches are first trimmed to
+	//SPECULATION_BUDGET_MB, dropping the counts farthest from LS_iterations
+	//(see evict_models) but not the two next to it: they are only built
+	//when they fit, and one that didn't fit after all would be dropped and
+	//built again on every idle pass. Room is made for the count to build by
+	//dropping counts farther away than it; if that isn't enough, nothing is
+	//dropped or built. Any input cancels it (when draw asks for something
+	//else or cancel_jobs), so it never keeps the input waiting.
+	void speculate(){
+		double budget = SPECULATION_BUDGET_MB*1048576;
+		evict_models(budget, 2);
+		{
+			lock_guard<mutex> lock(worker_mutex);
+			if(running.type != Job::NONE || requested.type != Job::NONE || !finished.empty())
+				return;
+		}
+		int neighbours[] = {LS_iterations + 1, LS_iterations - 1};
+		for(int i=0; i<2; i++){
+			int iterations = neighbours[i];
+			const TurtleInstances* instances;
+			const TurtleGeometry* geometry;
+			if(iterations < 0 || get_model(iterations, instances, geometry, false))
+				continue;
+			//(The cache it will go in is decided as in get_model)
+			double estimate = instancing && !instance_cache.count(iterations)?
+				estimate_bytes(instance_cache, iterations): estimate_bytes(geometry_cache, iterations);
+			double cache = evict_models(budget - estimate, 2, true);
+			if(cache + estimate > budget)
+				continue;
+			if(profiling)
+				printf("Building %d iterations ahead of time (about %.1f MB, with %.1f MB cached)\n",
+					iterations, estimate/1048576, cache/1048576);
+			get_model(iterations, instances, geometry, true, true);
+			return;
+		}
+	}
+
+	//Find the geometry for an iteration count in the caches: the instances
+	//(if instancing and the rules can be instanced), or else the interpreted
+	//geometry. Returns false, after asking the worker to build it (if
+	//request_missing, speculatively if speculative), if it isn't ready yet.
+	bool get_model(int iterations, const TurtleInstances*& instances, const TurtleGeometry*& geometry, bool request_missing = true, bool speculative = false){
+		instances = NULL;
+		geometry = NULL;
+		if(instancing){
+			map<int, TurtleInstances>::iterator it = instance_cache.find(iterations);
+			if(it == instance_cache.end()){
+				if(request_missing)
+					request(Job::INSTANCES, iterations, speculative);
+				return false;
+			}
+			if(it->second.root >= 0){
+				instances = &it->second;
+				return true;
+			}
+		}
+		map<int, TurtleGeometry>::iterator it = geometry_cache.find(iterations);
+		if(it == geometry_cache.end()){
+			if(request_missing)
+				request(Job::GEOMETRY, iterations, speculative);
+			return false;
+		}
+		geometry = &it->second;
+		return true;
+	}
 
-		string ls_string = L_system->GenerateSystemString(LS_iterations);
-		//cerr << "Drawing with " << LS_iterations << " iterations." << endl;
-		//cerr << "System string: " << ls_string << endl;
+	//The bounding box of the tree (tree-local) for the given iteration
+	//count, found from the rules without interpreting the string (or from
+	//the interpreted geometry if the rules can't be summarised)
+	TurtleBounds get_bounds(int iterations, const TurtleInstances* instances, const TurtleGeometry* geometry){
+		if (instances)
+			return instances->instances[instances->root].bounds;
+		TurtleBounds bounds;
+		Uint64 start = SDL_GetPerformanceCounter();
+		bool expanded = turtle.ExpandedBounds(program, iterations, bounds);
+		if (profiling){
+			double us = (SDL_GetPerformanceCounter() - start)*1e6/SDL_GetPerformanceFrequency();
+			if (expanded)
+				printf("Found the bounds [%.2f, %.2f] x [%.2f, %.2f] from the rules in %.1f us\n",
+					bounds.x0, bounds.x1, bounds.y0, bounds.y1, us);
+			else
+				printf("The rules can't be summarised (unbalanced brackets); using the interpreted bounds\n");
+		}
+		return expanded? bounds: geometry->bounds;
+	}
+
+	//True if the box (in screen coordinates) can't touch any pixel of the window
+	bool offscreen(const TurtleBounds& b){
+		//(Outlines can reach a pixel beyond the shape)
+		return b.empty() || b.x1 < -1 || b.y1 < -1 || b.x0 > WINDOW_SIZE_X || b.y0 > WINDOW_SIZE_Y;
+	}
+
+	//True if the box (in screen coordinates) should be drawn as an impostor
+	bool below_lod(const TurtleBounds& b){
+		return lod_pixels > 0 && !b.empty() && max(b.x1 - b.x0, b.y1 - b.y0) < lod_pixels;
+	}
+
+	//Cull a subtree (with the given tree-local bounds) drawn under the
+	//transform T if it is off-screen, or draw an impostor for it if it is
+	//below the level of detail threshold. Returns false if it must be drawn.
+	bool skip_subtree(const TurtleBounds& bounds, unsigned long leaves, unsigned long primitives, const Affine2d& T){
+		if (!culling && lod_pixels <= 0)
+			return false;
+		TurtleBounds box = bounds.transformed(T);
+		if (culling && offscreen(box)){
+			culled_branches++;
+			culled_primitives += primitives;
+			return true;
+		}
+		if (below_lod(box)){
+			draw_impostor(tr, leaves, primitives, box);
+			lod_branches++;
+			lod_primitives += primitives;
+			return true;
+		}
+		return false;
+	}
+
+	//True when the current slice has used up its time (checked every 64
+	//primitives; a deadline of 0 is never reached)
+	bool out_of_time(Uint64 deadline){
+		return (++slice_primitives & 63) == 0 && deadline > 0 && SDL_GetPerformanceCounter() > deadline;
+	}
+
+	//Draw one tree under the transform root, from its instances if the
+	//model has them (or else from the interpreted geometry), resuming where
+	//the last call stopped if tree_started. Returns false if the deadline
+	//passed before the tree was finished.
+	bool draw_tree(const TreeModel& model, const Affine2d& root, Uint64 deadline){
+		if(model.instances){
+			const TurtleInstances& instances = *model.instances;
+			if(!tree_started){
+				tree_started = true;
+				instance_stack.clear();
+				if(culling && offscreen(model.bounds.transformed(root)))
+					return true;
+				InstanceFrame frame = {instances.root, 0, root};
+				instance_stack.push_back(frame);
+			}
+			//(The instances are drawn depth first, as if by recursion, with
+			//the stack kept between slices)
+			while(!instance_stack.empty()){
+				InstanceFrame& frame = instance_stack.back();
+				const TurtleInstance& instance = instances.instances[frame.instance];
+				if(frame.item == instance.items.size()){
+					instance_stack.pop_back();
+					continue;
+				}
+				const TurtleInstanceItem& item = instance.items[frame.item++];
+				Affine2d transform = frame.transform*item.transform;
+				if(item.type == TURTLE_INSTANCE){
+					const TurtleInstance& sub = instances.instances[item.instance];
+					if(!skip_subtree(sub.bounds, sub.leaves, sub.primitives, transform)){
+						InstanceFrame sub_frame = {item.instance, 0, transform};
+						instance_stack.push_back(sub_frame);
+					}
+				}else{
+					tr.set_transform(transform);
+					draw_primitive(tr, item.type);
+					if(out_of_time(deadline))
+						return false;
+				}
+			}
+			return true;
+		}
+		const TurtleGeometry* geometry = model.geometry;
+		if(!tree_started){
+			tree_started = true;
+			next_primitive = next_branch = 0;
+			if(culling && offscreen(geometry->bounds.transformed(root)))
+				return true;
+		}
+		//b is the next branch record; a branch which is entirely
+		//off-screen (or below the level of detail threshold, in which
+		//case an impostor is drawn instead) is skipped in one step,
+		//sub-branches included
+		const vector<TurtleBranch>& branches = geometry->branches;
+		unsigned int& j = next_primitive;
+		unsigned int& b = next_branch;
+		while(j<geometry->primitives.size()){
+			if(b < branches.size() && branches[b].first == j){
+				const TurtleBranch& branch = branches[b];
+				if(skip_subtree(branch.bounds, branch.leaves, branch.end - branch.first, root)){
+					j = branch.end;
+					b = branch.next;
+				}else
+					b++;
+				continue;
+			}
+			const TurtlePrimitive& p = geometry->primitives[j++];
+			tr.set_transform(root*Affine2d(p.transform));
+			draw_primitive(tr, p.type);
+			if(out_of_time(deadline))
+				return false;
+		}
+		return true;
+	}
+
+	//A well mixed hash of x (the forest's random numbers)
+	static unsigned int hash(unsigned int x){
+		x ^= x >> 16;
+		x *= 0x7feb352d;
+		x ^= x >> 15;
+		x *= 0x846ca68b;
+		x ^= x >> 16;
+		return x;
+	}
+	//A random number in [0, 1) from the kth hash of seed
+	static double random(unsigned int seed, unsigned int k){
+		return (hash(seed + k) & 0xffffff)/16777216.0;
+	}
+
+	//Find the geometry for each iteration count to be drawn: LS_iterations,
+	//or for a forest the FOREST_SPREAD + 1 counts up to it. A count which
+	//isn't built yet is asked of the worker. When drawing progressively
+	//the largest smaller count which is built stands in for it meanwhile,
+	//and exact is set to false. Returns false if there is nothing to draw.
+	bool get_tree_models(bool& exact){
+		tree_models.resize(forest? min(LS_iterations, FOREST_SPREAD) + 1: 1);
+		exact = true;
+		for(unsigned int m=0; m<tree_models.size(); m++){
+			TreeModel& model = tree_models[m];
+			model.iterations = LS_iterations - m;
+			//(Only the first missing count is requested, since a request
+			//cancels the one before)
+			if(!get_model(model.iterations, model.instances, model.geometry, exact)){
+				exact = false;
+				if(!progressive)
+					return false;
+				do
+					model.iterations--;
+				while(model.iterations >= 0 && !get_model(model.iterations, model.instances, model.geometry, false));
+				if(model.iterations < 0)
+					return false;
+			}
+			if(model.instances){
+				const TurtleInstance& tree = model.instances->instances[model.instances->root];
+				model.bounds = tree.bounds;
+				model.primitives = tree.primitives;
+				model.leaves = tree.leaves;
+			}else{
+				model.bounds = model.geometry->bounds;
+				model.primitives = model.geometry->primitives.size();
+				model.leaves = model.geometry->leaves;
+			}
+		}
+		return true;
+	}
+
+	//Place num_trees trees in rows receding from the viewer (after the view
+	//transform), the back row first. Each tree's seed sets its position,
+	//size, mirroring and iteration count (one of the FOREST_SPREAD + 1
+	//counts up to LS_iterations); the trees with the same count share its
+	//cached geometry, and each is drawn as an instance of it under its own
+	//root transform. The trees are placed and culled (or reduced to an
+	//impostor) in parallel, and drawn in order by draw_slice. Only the
+	//placement is split between threads: there is no per-tree
+	//interpretation to parallelize (each count's geometry is built once by
+	//the worker, itself on every thread), drawing has to go through the one
+	//renderer in order so that nearer trees cover farther ones, and the
+	//tiled backend already rasterizes on every thread.
+	void place_forest(const Affine2d& view){
+		int counts = tree_models.size();
+		//Scale so the largest tree in the front row is at most 60% of the
+		//window's height and two columns wide
+		int columns = (int)ceil(sqrt(2.0*num_trees)), rows = (num_trees + columns - 1)/columns;
+		const TurtleBounds& b = tree_models[0].bounds;
+		double k = 1;
+		if(!b.empty())
+			k = min(0.6*WINDOW_SIZE_Y/max(b.y1 - b.y0, 1e-3f), 2.0*WINDOW_SIZE_X/(columns*max(b.x1 - b.x0, 1e-3f)));
+		double row_height = 0.55*WINDOW_SIZE_Y/rows;
+		placed_trees.resize(num_trees);
+		const int BLOCK = 256;
+		ParallelFor((num_trees + BLOCK - 1)/BLOCK, threads, [&](int block){
+			for(int i=block*BLOCK; i<min(num_trees, (block + 1)*BLOCK); i++){
+				PlacedTree& t = placed_trees[i];
+				unsigned int seed = hash(forest_seed*0x9e3779b9u + i);
+				int row = i/columns, column = i%columns;
+				double depth = (row + 1.0)/rows; //1 for the front row
+				double x = (column + 0.1 + 0.8*random(seed, 0))*WINDOW_SIZE_X/columns;
+				double y = 0.4*WINDOW_SIZE_Y + depth*0.55*WINDOW_SIZE_Y + (random(seed, 1) - 0.5)*row_height;
+				double size = k*(0.35 + 0.65*depth)*(0.75 + 0.25*random(seed, 2));
+				double mirror = random(seed, 3) < 0.5? -1: 1;
+				t.model = hash(seed + 4) % counts;
+				t.root = view;
+				t.root.translate(x, y);
+				t.root.scale(mirror*size, -size);
+				t.box = tree_models[t.model].bounds.transformed(t.root);
+				if(culling && offscreen(t.box))
+					t.state = PlacedTree::CULLED;
+				else if(below_lod(t.box))
+					t.state = PlacedTree::IMPOSTOR;
+				else
+					t.state = PlacedTree::DRAWN;
+			}
+		});
+	}
+
+	//The state the frame for the window would be drawn from
+	Scene get_scene(SDL_Renderer *renderer){
+		Scene scene;
+		scene.iterations = LS_iterations;
+		scene.num_trees = num_trees;
+		SDL_GetRendererOutputSize(renderer, &scene.width, &scene.height);
+		scene.zoom = zoom;
+		scene.forest = forest;
+		scene.forest_seed = forest_seed;
+		scene.auto_fit = auto_fit;
+		scene.instancing = instancing;
+		scene.peephole = peephole;
+		scene.culling = culling;
+		scene.lod_pixels = lod_pixels;
+		scene.backend = tr.get_backend();
+		scene.batching = tr.is_batching();
+		return scene;
+	}
+
+	//The cached frame for a scene (-1 if there is none)
+	int find_frame(const Scene& scene){
+		for(unsigned int i=0; i<frame_cache.size(); i++)
+			if(frame_cache[i].scene == scene)
+				return i;
+		return -1;
+	}
+	//Find the cached frame for a scene, or make one to draw it in: a new
+	//texture, or once there are FRAME_CACHE_SIZE, the least recently
+	//presented frame's (other than the one shown). Returns -1 if the
+	//renderer can't draw to textures.
+	int get_frame(SDL_Renderer *renderer, const Scene& scene){
+		int frame = find_frame(scene);
+		if(frame >= 0)
+			return frame;
+		for(unsigned int i=0; i<frame_cache.size(); i++)
+			if((int)i != frame_shown && (frame < 0 || frame_cache[i].used < frame_cache[frame].used))
+				frame = i;
+		if(!SDL_RenderTargetSupported(renderer))
+			return -1;
+		if((int)frame_cache.size() < FRAME_CACHE_SIZE || frame < 0){
+			CachedFrame cached;
+			cached.texture = NULL;
+			frame = frame_cache.size();
+			frame_cache.push_back(cached);
+		}
+		CachedFrame& cached = frame_cache[frame];
+		if(cached.texture && (cached.scene.width != scene.width || cached.scene.height != scene.height)){
+			SDL_DestroyTexture(cached.texture);
+			cached.texture = NULL;
+		}
+		if(!cached.texture){
+			cached.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scene.width, scene.height);
+			if(cached.texture)
+				SDL_SetTextureBlendMode(cached.texture, SDL_BLENDMODE_NONE);
+		}
+		if(!cached.texture){
+			frame_cache.erase(frame_cache.begin() + frame);
+			if(frame_shown > frame)
+				frame_shown--;
+			return -1;
+		}
+		cached.scene = scene;
+		cached.complete = false;
+		cached.used = frame_clock;
+		return frame;
+	}
 
+	//Mark the cached frames as lost (after the render targets were reset),
+	//or if destroy (the device was reset) throw them away
+	void forget_frames(bool destroy){
+		frame_pending = false;
+		frame_shown = -1;
+		for(unsigned int i=0; i<frame_cache.size(); i++){
+			frame_cache[i].complete = false;
+			if(destroy)
+				SDL_DestroyTexture(frame_cache[i].texture);
+		}
+		if(destroy)
+			frame_cache.clear();
+	}
+
+	//Present the frame being drawn (copying it to the window, unless it is
+	//drawn there)
+	void present(SDL_Renderer *renderer){
+		if(frame_target >= 0){
+			SDL_SetRenderTarget(renderer, NULL);
+			SDL_RenderCopy(renderer, frame_cache[frame_target].texture, NULL, NULL);
+			frame_cache[frame_target].used = ++frame_clock;
+		}
+		SDL_RenderPresent(renderer);
+	}
+
+	//Present the last complete frame scaled (with SDL_gfx's zoomSurface)
+	//by the change in zoom and window size, about the centre of the
+	//window, as a quick preview of the scene. The part of it which will
+	//be on screen is read back from its texture and scaled. (With auto_fit
+	//that is how the trees move; otherwise it is only approximate.)
+	void draw_scaled(SDL_Renderer *renderer, const Scene& scene){
+		const CachedFrame& shown = frame_cache[frame_shown];
+		const Scene& old = shown.scene;
+		double k = scene.zoom/old.zoom;
+		if(scene.width != old.width || scene.height != old.height)
+			k *= min(scene.width/(double)old.width, scene.height/(double)old.height);
+		int x0 = max(0, (int)floor(old.width/2.0 - scene.width/(2*k)));
+		int y0 = max(0, (int)floor(old.height/2.0 - scene.height/(2*k)));
+		int x1 = min(old.width, (int)ceil(old.width/2.0 + scene.width/(2*k)));
+		int y1 = min(old.height, (int)ceil(old.height/2.0 + scene.height/(2*k)));
+		SDL_SetRenderTarget(renderer, NULL);
 		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 		SDL_RenderClear(renderer);
-        double window_scale_x = WINDOW_SIZE_X / (double)DEFAULT_SIZE_X;
-        double window_scale_y = WINDOW_SIZE_Y / (double)DEFAULT_SIZE_Y;
-        double init_scale_x = 6*window_scale_x / double(num_trees/2 + 1);
-        double init_scale_y = 6*window_scale_y / double(num_trees/2 + 1);
-        if(init_scale_x < 1) init_scale_x = 1;
-        if(init_scale_y < 1) init_scale_y = 1;
-		TransformedRenderer tr(renderer);
-		Matrix3 transform, init_transform;
-		transform.identity();
-        init_transform.identity();
-        init_transform *= Translation(WINDOW_SIZE_X/(num_trees + 1), WINDOW_SIZE_Y);
-        init_transform *= Scale(init_scale_x, -init_scale_y);
-		
-        for(unsigned int i=0; i<num_trees; i++){  
-            while(!t_stack.empty()) t_stack.pop();
-            transform = init_transform * Translation(i*WINDOW_SIZE_X/(init_scale_x*(num_trees+1)),0);
-            tr.set_transform(transform);
-            for(unsigned int j=0; j<ls_string.size(); j++){
-                switch(ls_string[j]){
-                        case 'L':
-                            draw_leaf(tr);
-                            break;
-                        case 'T':
-                            draw_stem(tr);
-                            transform *= Translation(0,6);
-                            break;
-                        case '+':
-                            transform *= Rotation(M_PI/6); 
-                            break;
-                        case '-':
-                            transform *= Rotation(-M_PI/6); 
-                            break;
-                        case 's':
-                            transform *= Scale(0.9,0.9);
-                            break;
-                        case 'S':
-                            transform *= Scale(1/0.9,1/0.9);
-                            break;
-                        case 'h':
-                            transform *= Scale(0.9,1);
-                            break;
-                        case 'H':
-                            transform *= Scale(1/0.9,1);
-                            break;
-                        case 'v':
-                            transform *= Scale(1,0.9);
-                            break;
-                        case 'V':
-                            transform *= Scale(1,1/0.9);
-                            break;
-                        case '[':
-                            t_stack.push(transform);
-                            break;
-                        case ']':
-                            transform = t_stack.top();
-                            t_stack.pop();
-                            break;
-                        default:
-                            break;
-                }
-                tr.set_transform(transform);
+		SDL_Surface* part = x1 > x0 && y1 > y0? SDL_CreateRGBSurfaceWithFormat(0, x1 - x0, y1 - y0, 32, SDL_PIXELFORMAT_ARGB8888): NULL;
+		if(part){
+			SDL_Rect source = {x0, y0, x1 - x0, y1 - y0};
+			SDL_SetRenderTarget(renderer, shown.texture);
+			SDL_RenderReadPixels(renderer, &source, SDL_PIXELFORMAT_ARGB8888, part->pixels, part->pitch);
+			SDL_SetRenderTarget(renderer, NULL);
+			SDL_Surface* scaled = zoomSurface(part, k, k, SMOOTHING_ON);
+			SDL_Texture* texture = scaled? SDL_CreateTextureFromSurface(renderer, scaled): NULL;
+			if(texture){
+				SDL_Rect dest = {(int)floor(scene.width/2.0 + k*(x0 - old.width/2.0) + 0.5),
+					(int)floor(scene.height/2.0 + k*(y0 - old.height/2.0) + 0.5), scaled->w, scaled->h};
+				SDL_RenderCopy(renderer, texture, NULL, &dest);
+				SDL_DestroyTexture(texture);
+			}
+			SDL_FreeSurface(scaled);
+			SDL_FreeSurface(part);
+		}
+		SDL_RenderPresent(renderer);
+	}
+
+	//Start a new frame for the current state and draw the first slice of
+	//it (or present it from the cache, or a scaled preview of it if only
+	//the zoom or window size changed and scaling is allowed). Returns true
+	//if anything was presented.
+	bool draw(SDL_Renderer *renderer, float frame_delta_ms, bool allow_scaling = true){
+		//float frame_delta_seconds = frame_delta_ms/1000.0;
+
+		//Until the worker has built the geometry, a preview is drawn (or,
+		//if there is none, the last frame stays up)
+		frame_pending = false;
+		settling = false;
+		collect_jobs();
+		Scene scene = get_scene(renderer);
+		frame_target = find_frame(scene);
+		if(frame_target >= 0 && frame_cache[frame_target].complete){
+			cancel_jobs();
+			present(renderer);
+			frame_shown = frame_target;
+			if (profiling)
+				printf("Presented the cached frame\n");
+			return true;
+		}
+		if(allow_scaling && frame_shown >= 0 && frame_cache[frame_shown].scene.same_but_view(scene)){
+			draw_scaled(renderer, scene);
+			settling = true;
+			settle_time = SDL_GetTicks() + SETTLE_MS;
+			return true;
+		}
+		bool exact;
+		if(!get_tree_models(exact))
+			return false;
+		//(Only now that there is something to draw, since this can evict a frame)
+		frame_target = get_frame(renderer, scene);
+		if(exact)
+			cancel_jobs();
+		const TreeModel& model = tree_models[0];
+
+		frame_exact = exact;
+		if(frame_target >= 0)
+			SDL_SetRenderTarget(renderer, frame_cache[frame_target].texture);
+		tr.set_renderer(renderer);
+		tr.clear(0, 0, 0, 255);
+		tr.reset_clip_stats();
+		Affine2d init_transform;
+        if(zoom != 1){
+            init_transform.translate(WINDOW_SIZE_X/2.0, WINDOW_SIZE_Y/2.0);
+            init_transform.scale(zoom, zoom);
+            init_transform.translate(-WINDOW_SIZE_X/2.0, -WINDOW_SIZE_Y/2.0);
+        }
+        Affine2d view = init_transform; //(The forest does its own layout)
+        double tree_spacing; //Between the roots of the trees (tree-local)
+        TurtleBounds bounds;
+        if(auto_fit && !forest)
+            bounds = get_bounds(model.iterations, model.instances, model.geometry);
+        if(!bounds.empty()){
+            //Centre the first tree's bounding box in the first of num_trees
+            //equal columns, at the largest scale that fits (with a margin)
+            double w = max(bounds.x1 - bounds.x0, 1e-3f), h = max(bounds.y1 - bounds.y0, 1e-3f);
+            double fit_scale = 0.9*min(WINDOW_SIZE_X/(w*num_trees), WINDOW_SIZE_Y/h);
+            init_transform.translate(WINDOW_SIZE_X/(2.0*num_trees), WINDOW_SIZE_Y/2.0);
+            init_transform.scale(fit_scale, -fit_scale);
+            init_transform.translate(-(bounds.x0 + bounds.x1)/2, -(bounds.y0 + bounds.y1)/2);
+            tree_spacing = WINDOW_SIZE_X/(fit_scale*num_trees);
+        }else{
+            double window_scale_x = WINDOW_SIZE_X / (double)DEFAULT_SIZE_X;
+            double window_scale_y = WINDOW_SIZE_Y / (double)DEFAULT_SIZE_Y;
+            double init_scale_x = 6*window_scale_x / double(num_trees/2 + 1);
+            double init_scale_y = 6*window_scale_y / double(num_trees/2 + 1);
+            if(init_scale_x < 1) init_scale_x = 1;
+            if(init_scale_y < 1) init_scale_y = 1;
+            init_transform.translate(WINDOW_SIZE_X/(num_trees + 1), WINDOW_SIZE_Y);
+            init_transform.scale(init_scale_x, -init_scale_y);
+            tree_spacing = WINDOW_SIZE_X/(init_scale_x*(num_trees+1));
+        }
+        culled_branches = culled_primitives = 0;
+        lod_branches = lod_primitives = 0;
+        forest_culled = forest_impostors = 0;
+
+        Uint64 place_start = SDL_GetPerformanceCounter();
+        if(forest){
+            place_forest(view);
+        }else{
+            placed_trees.resize(num_trees);
+            for(int i=0; i<num_trees; i++){
+                PlacedTree& t = placed_trees[i];
+                t.state = PlacedTree::DRAWN;
+                t.model = 0;
+                t.root = init_transform;
+                t.root.translate(i*tree_spacing,0);
             }
         }
+        frame_primitives = 0; //Drawn (or culled or replaced by impostors)
+        for(int i=0; i<num_trees; i++)
+            frame_primitives += tree_models[placed_trees[i].model].primitives;
+        frame_ms = (SDL_GetPerformanceCounter() - place_start)*1000.0/SDL_GetPerformanceFrequency();
+        frame_slices = 0;
+        next_tree = 0;
+        tree_started = false;
+        frame_pending = true;
+        if (profiling && !exact)
+            printf("Drawing a preview with %d iterations\n", model.iterations);
+        return draw_slice(renderer);
+	}
+
+	//Continue drawing the current frame, for up to FRAME_BUDGET_MS if
+	//drawing progressively (or else to the end). Returns true if anything
+	//was presented: the finished frame, or the frame so far if it is drawn
+	//in a texture or with the software backends (which keep it, so the
+	//next slice draws on over it; SDL's back buffer isn't kept, so there a
+	//frame is only presented once it is finished).
+	bool draw_slice(SDL_Renderer *renderer){
+		Uint64 start = SDL_GetPerformanceCounter();
+		if(frame_target >= 0)
+			SDL_SetRenderTarget(renderer, frame_cache[frame_target].texture);
+		Uint64 deadline = progressive? start + (Uint64)(FRAME_BUDGET_MS*SDL_GetPerformanceFrequency()/1000): 0;
+		slice_primitives = 0;
+		bool finished = true;
+		for(; next_tree<placed_trees.size(); next_tree++, tree_started = false){
+			const PlacedTree& t = placed_trees[next_tree];
+			const TreeModel& model = tree_models[t.model];
+			if(t.state == PlacedTree::CULLED){
+				forest_culled++;
+				culled_branches++;
+				culled_primitives += model.primitives;
+			}else if(t.state == PlacedTree::IMPOSTOR){
+				forest_impostors++;
+				draw_impostor(tr, model.leaves, model.primitives, t.box);
+				lod_branches++;
+				lod_primitives += model.primitives;
+			}else if(!draw_tree(model, t.root, deadline)){
+				finished = false;
+				break;
+			}
+		}
 		
+		tr.flush();
+		frame_ms += (SDL_GetPerformanceCounter() - start)*1000.0/SDL_GetPerformanceFrequency();
+		frame_slices++;
+		if(!finished){
+			if(frame_target < 0 && !tr.keeps_frame())
+				return false;
+			present(renderer);
+			return true;
+		}
+		frame_pending = false;
+		if(frame_target >= 0 && frame_exact){
+			frame_cache[frame_target].complete = true;
+			frame_shown = frame_target;
+		}
+		if (profiling){
+			printf("Drew %.0f primitives in %.2f ms (%.1f ns/primitive, %d slice%s)\n",
+				frame_primitives, frame_ms, frame_primitives > 0? frame_ms*1e6/frame_primitives: 0.0,
+				frame_slices, frame_slices == 1? "": "s");
+			TransformedRenderer::ClipStats clip = tr.get_clip_stats();
+			printf("Clipping: %lu of %lu shapes rejected off-screen, %lu clipped\n",
+				clip.rejected, clip.primitives, clip.clipped);
+			printf("Culling: %lu branches skipped (%lu primitives)\n", culled_branches, culled_primitives);
+			printf("Level of detail: %lu branches drawn as impostors (%lu primitives)\n", lod_branches, lod_primitives);
+			if (forest)
+				printf("Forest: %d trees, %lu culled, %lu drawn as impostors\n", num_trees, forest_culled, forest_impostors);
+		}
 	
-		SDL_RenderPresent(renderer);
+		present(renderer);
+		return true;
 	}
 };
 
@@ -235,6 +1289,13 @@ int main(int argc, char** argv){
 		cerr << "Parsing failed." << endl;
 		return 0;
 	}
+	TurtleInterpreter turtle;
+	string error;
+	if (!turtle.Configure(L->GetDirectives(), error)){
+		cerr << "Invalid directive: " << error << endl;
+		delete L;
+		return 0;
+	}
 
 	SDL_Window* window = SDL_CreateWindow("CSC 205 A3",
                               SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
@@ -248,9 +1309,12 @@ int main(int argc, char** argv){
 	SDL_RenderClear(renderer);
 	SDL_RenderPresent(renderer);
 	
-	A3Canvas canvas(L);
+	{
+		//(The canvas stops its worker, which uses L, when it goes out of scope)
+		A3Canvas canvas(L, turtle);
 
-	canvas.frame_loop(renderer, window);
+		canvas.frame_loop(renderer, window);
+	}
 	
 	delete L;
 	
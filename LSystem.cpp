@@ -15,8 +15,11 @@
 
 using namespace std;
 
-void LSystem::GenerateRecursive(string& buf, string input,int iterations,int maxIterations){
+//Returns false if the job was cancelled
+bool LSystem::GenerateRecursive(string& buf, const string& input,int iterations,int maxIterations, Rule* source, bool profile, const GenerationCancel* cancel){
 	for (unsigned int i = 0; i < input.length(); i++){
+		if (cancel && i % GenerationCancel::CHECK_INTERVAL == GenerationCancel::CHECK_INTERVAL - 1 && cancel->cancelled())
+			return false;
 		if (iterations < maxIterations){
 			list<Rule>::iterator rule = rules.begin();
 			for( ; rule != rules.end(); rule++ ){
@@ -24,14 +27,25 @@ void LSystem::GenerateRecursive(string& buf, string input,int iterations,int max
 					//Even if this rule matches, it might need to be ignored
 					//either because it's dead or because one of its flags
 					//causes it to be ignored
-					if (	(rule->lifetime > 0 && rule->lifetime < iterations) 
-						 || (rule->lifetime < 0 && (maxIterations + rule->lifetime) <= iterations)
-						 || ((iterations%2 == 1) && (rule->flags & FLAG_EVEN)) //Even flag (don't expand on odd numbered iterations)
-						 || ((iterations%2 == 0) && (rule->flags & FLAG_ODD)) //Odd flag (don't expand on even numbered iterations)
-						 )
-						 continue;
+					bool dead = rule->Dead(iterations, maxIterations);
+					bool wrongParity = rule->WrongParity(iterations);
+					if (dead || wrongParity){
+						if (profile){
+							if (dead)
+								rule->stats[iterations].skipped_lifetime++;
+							else
+								rule->stats[iterations].skipped_parity++;
+						}
+						continue;
+					}
+					if (profile)
+						rule->stats[iterations].fired++;
 					//If the rule passes the above test, substitute recursively
-					GenerateRecursive(buf,rule->substitution,iterations+1,maxIterations);
+					//(checking for cancellation once per expansion)
+					if (cancel && cancel->cancelled())
+						return false;
+					if (!GenerateRecursive(buf,rule->substitution,iterations+1,maxIterations,&*rule,profile,cancel))
+						return false;
 					break;
 				}
 			}
@@ -39,15 +53,83 @@ void LSystem::GenerateRecursive(string& buf, string input,int iterations,int max
 				continue;
 		}
 		buf += input[i];
+		if (profile && source)
+			source->stats[iterations-1].symbols_emitted++;
 	}
+	return true;
+}
+
+const string* LSystem::GetSubstitution(char c, int iterations, int maxIterations) const{
+	if (iterations >= maxIterations)
+		return NULL;
+	for (list<Rule>::const_iterator rule = rules.begin(); rule != rules.end(); rule++)
+		if (rule->rule == c && !rule->Dead(iterations, maxIterations) && !rule->WrongParity(iterations))
+			return &rule->substitution;
+	return NULL;
+}
+
+bool LSystem::HasRule(char c) const{
+	for (list<Rule>::const_iterator rule = rules.begin(); rule != rules.end(); rule++)
+		if (rule->rule == c)
+			return true;
+	return false;
+}
+
+void LSystem::GetSubstitutions(vector<const string*>& out) const{
+	out.clear();
+	for (list<Rule>::const_iterator rule = rules.begin(); rule != rules.end(); rule++)
+		out.push_back(&rule->substitution);
 }
 
 string LSystem::GenerateSystemString(int iterations){
+	return GenerateSystemString(iterations, profiling);
+}
+
+string LSystem::GenerateSystemString(int iterations, bool profile, const GenerationCancel* cancel){
 	string buf;
-	GenerateRecursive(buf,axiom,0,iterations);
+	if (profile)
+		for (list<Rule>::iterator rule = rules.begin(); rule != rules.end(); rule++)
+			rule->stats.assign(iterations > 0? iterations: 0, RuleDepthStats());
+	GenerateRecursive(buf,axiom,0,iterations,NULL,profile,cancel);
 	return buf;
 }
 
+vector<LSystem::RuleProfile> LSystem::GetProfile() const{
+	vector<RuleProfile> profile;
+	for (list<Rule>::const_iterator rule = rules.begin(); rule != rules.end(); rule++){
+		RuleProfile p;
+		p.rule = rule->rule;
+		p.substitution = rule->substitution;
+		p.flags = rule->flags;
+		p.lifetime = rule->lifetime;
+		p.depth = rule->stats;
+		profile.push_back(p);
+	}
+	return profile;
+}
+
+void LSystem::PrintProfile(FILE* f) const{
+	fprintf(f,"%5s %5s %12s %12s %12s %14s\n","Rule","Depth","Fired","Dead","Parity","Symbols");
+	int index = 0;
+	for (list<Rule>::const_iterator rule = rules.begin(); rule != rules.end(); rule++, index++){
+		fprintf(f,"#%d: %d %s%s%c = %s\n",index,rule->lifetime,
+			(rule->flags & FLAG_EVEN)? "%": "",(rule->flags & FLAG_ODD)? "^": "",
+			rule->rule,rule->substitution.c_str());
+		RuleDepthStats total;
+		for (unsigned int d = 0; d < rule->stats.size(); d++){
+			const RuleDepthStats& s = rule->stats[d];
+			if (!s.fired && !s.skipped_lifetime && !s.skipped_parity)
+				continue;
+			fprintf(f,"%5c %5u %12lu %12lu %12lu %14lu\n",rule->rule,d,s.fired,s.skipped_lifetime,s.skipped_parity,s.symbols_emitted);
+			total.fired += s.fired;
+			total.skipped_lifetime += s.skipped_lifetime;
+			total.skipped_parity += s.skipped_parity;
+			total.symbols_emitted += s.symbols_emitted;
+		}
+		fprintf(f,"%5c %5s %12lu %12lu %12lu %14lu\n",rule->rule,"all",total.fired,total.skipped_lifetime,total.skipped_parity,total.symbols_emitted);
+	}
+}
+
 void LSystem::addRule(char ruleChar, const char* substitution,int flags,int lifetime){
 	Rule r(ruleChar,substitution,flags,lifetime);
 	rules.push_back(r);
@@ -93,6 +175,10 @@ LSystem* LSystem::ParseFile(string filename){
 		if (!curLine[0] || curLine[0] == '#')
 			continue;
 		removeTrailingWhitespace(curLine);
+		if (curLine[0] == '@'){
+			sys->directives.push_back(curLine + 1);
+			continue;
+		}
 		sys->axiom = curLine;
 		found_axiom = true;
 		break;
@@ -111,6 +197,11 @@ LSystem* LSystem::ParseFile(string filename){
 		eatWhitespace(curLine);
 		if (!curLine[0] || curLine[0] == '#')
 			continue;
+		if (curLine[0] == '@'){
+			removeTrailingWhitespace(curLine);
+			sys->directives.push_back(curLine + 1);
+			continue;
+		}
 		lifetime = strtol(curLine,&curLine,10);
 		eatWhitespace(curLine);
 		readingFlags = 1;
@@ -11,39 +11,114 @@
 #include <string>
 #include <cstring>
 #include <list>
+#include <vector>
+#include <atomic>
 
 using namespace std;
 
+//Lets a long generation on one thread be abandoned from another: the job
+//is cancelled once *current no longer equals token (so bumping a shared
+//counter cancels every older job). Used by GenerateSystemString and by
+//the turtle (as TurtleCancel).
+struct GenerationCancel{
+	//Loops over single symbols or actions check it once per this many
+	//(a relaxed load is cheap, but not next to one action)
+	static const unsigned int CHECK_INTERVAL = 4096;
+	const atomic<unsigned int>* current;
+	unsigned int token;
+	GenerationCancel(const atomic<unsigned int>& current, unsigned int token): current(&current), token(token){ }
+	bool cancelled() const{ return current->load(memory_order_relaxed) != token; }
+};
+
 class LSystem{
 public:
 	~LSystem(){ }
 	
 	//Generate a string from the current system with the given number of iterations
 	string GenerateSystemString(int iterations);
+	//The same, recording the rule profile only if profile is true (whatever
+	//SetProfiling says), so a caller on another thread can decide for itself.
+	//If cancel is given and the job is cancelled, stops as soon as it
+	//notices (the string and the profile are then incomplete).
+	string GenerateSystemString(int iterations, bool profile, const GenerationCancel* cancel = NULL);
 	
 	//Generate an LSystem object by parsing the given file
 	//(LSystem object must be freed by the caller)
 	static LSystem* ParseFile(string filename);
+	
+	//The string for 0 iterations
+	const string& GetAxiom() const{ return axiom; }
+	//Lines in the file starting with '@' (without the '@'), in order,
+	//which are left to the interpreter (see turtle.h)
+	const vector<string>& GetDirectives() const{ return directives; }
+	//The substitution which replaces the symbol c when it is reached at the
+	//given iteration while generating maxIterations iterations (from the
+	//first rule for c which is alive and has the right parity), or NULL
+	//if c is copied unchanged
+	const string* GetSubstitution(char c, int iterations, int maxIterations) const;
+	//True if any rule replaces c
+	bool HasRule(char c) const;
+	//Every rule's substitution, in file order (the pointers GetSubstitution returns)
+	void GetSubstitutions(vector<const string*>& out) const;
 
 	enum RuleFlags{
 		FLAG_EVEN = 1, //Only expand on even numbered iterations ('%' character)
 		FLAG_ODD = 2, //Only expand on odd numbered iterations ('^' character)
 	};
 	
+	//Counters for one rule at one iteration depth
+	struct RuleDepthStats{
+		unsigned long fired; //Number of times the rule was substituted
+		unsigned long skipped_lifetime; //Matches ignored because the rule was dead
+		unsigned long skipped_parity; //Matches ignored because of the even/odd flags
+		unsigned long symbols_emitted; //Output symbols copied directly from the substitution
+		RuleDepthStats(): fired(0),skipped_lifetime(0),skipped_parity(0),symbols_emitted(0){ }
+	};
+	struct RuleProfile{
+		char rule;
+		string substitution;
+		int flags;
+		int lifetime;
+		vector<RuleDepthStats> depth; //Indexed by the iteration at which the rule matched
+	};
+	
+	//When profiling is enabled, each call to GenerateSystemString records
+	//per-rule firing counts (the previous counts are discarded)
+	void SetProfiling(bool enabled){ profiling = enabled; }
+	bool IsProfiling() const{ return profiling; }
+	//Counters from the last profiled generation (one entry per rule, in file order)
+	vector<RuleProfile> GetProfile() const;
+	//Print the profile as a table
+	void PrintProfile(FILE* f = stdout) const;
+	
 private:
 
-	LSystem(){ }
+	LSystem(): profiling(false){ }
 	string axiom;
+	vector<string> directives;
 	struct Rule{
 		char rule;
 		string substitution;
 		int flags;
 		int lifetime;
+		vector<RuleDepthStats> stats; //Only filled in when profiling
 		Rule(char rule, string substitution, int flags=0,int lifetime=0):
 			rule(rule),substitution(substitution),flags(flags),lifetime(lifetime){ }
+		//The rule's lifetime has run out at this iteration
+		bool Dead(int iterations, int maxIterations) const{
+			return (lifetime > 0 && lifetime < iterations)
+				|| (lifetime < 0 && (maxIterations + lifetime) <= iterations);
+		}
+		//One of the rule's flags causes it to be ignored at this iteration
+		bool WrongParity(int iterations) const{
+			return ((iterations%2 == 1) && (flags & FLAG_EVEN)) //Even flag (don't expand on odd numbered iterations)
+				|| ((iterations%2 == 0) && (flags & FLAG_ODD)); //Odd flag (don't expand on even numbered iterations)
+		}
 	};
 	list<Rule> rules;
-	void GenerateRecursive(string& buf, string input,int iterations, int maxIterations);
+	bool profiling;
+	//source is the rule whose substitution is being expanded (NULL for the axiom)
+	bool GenerateRecursive(string& buf, const string& input,int iterations, int maxIterations, Rule* source, bool profile, const GenerationCancel* cancel);
 
 	void addRule(char ruleChar, const char* substitution,int flags = 0,int lifetime = 0);
 	
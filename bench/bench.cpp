@@ -0,0 +1,466 @@
+/* bench.cpp
+
+   Timings for the transform code used by LSViewer (make bench, then run
+   bench/LSBench [input file] [iterations] from the top directory).
+   Each case is run repeatedly for a fixed time and the fastest run is
+   reported, per symbol (or per point, matrix, etc.).
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <stack>
+#include <vector>
+#include <chrono>
+#include "LSystem.h"
+#include "turtle.h"
+#include "matrix.h"
+#include "parallel.h"
+
+using namespace std;
+
+static const double BENCH_SECONDS = 0.5;
+
+//Keeps the optimizer from dropping results which are never used
+static volatile float bench_sink;
+
+//Run f until BENCH_SECONDS have passed and return the fastest run in
+//nanoseconds per item
+template<class F>
+static double Time(unsigned long items, F f){
+	typedef chrono::steady_clock clock;
+	double best = 1e300, total = 0;
+	do{
+		clock::time_point start = clock::now();
+		f();
+		double ns = chrono::duration<double, nano>(clock::now() - start).count();
+		if (ns < best)
+			best = ns;
+		total += ns;
+	}while (total < BENCH_SECONDS*1e9);
+	return best/(items? items: 1);
+}
+
+static void Report(const char* name, double ns, const char* unit){
+	printf("  %-40s %10.2f ns/%s\n", name, ns, unit);
+}
+
+
+//The turtle as it was before Affine2: every symbol builds a Matrix3 (with
+//cos and sin for rotations) and multiplies the turtle's transform by it,
+//and '[' pushes a whole Matrix3
+static Matrix3 Rotation(float radians){
+	Matrix3 M;
+	M.identity();
+	M(0,0) = M(1,1) = cos(radians);
+	M(1,0) = -(M(0,1) = sin(radians));
+	return M;
+}
+static Matrix3 Translation(float tx, float ty){
+	Matrix3 M;
+	M.identity();
+	M(0,2) = tx;
+	M(1,2) = ty;
+	return M;
+}
+static Matrix3 Scale(float sx, float sy){
+	Matrix3 M;
+	M.identity();
+	M(0,0) = sx;
+	M(1,1) = sy;
+	return M;
+}
+static void InterpretMatrix3(const string& s, vector<Matrix3>& out){
+	stack<Matrix3> t_stack;
+	Matrix3 transform;
+	transform.identity();
+	out.clear();
+	for (unsigned int j = 0; j < s.size(); j++){
+		switch(s[j]){
+			case 'L':
+				out.push_back(transform);
+				break;
+			case 'T':
+				out.push_back(transform);
+				transform *= Translation(0,6);
+				break;
+			case '+':
+				transform *= Rotation(M_PI/6);
+				break;
+			case '-':
+				transform *= Rotation(-M_PI/6);
+				break;
+			case 's':
+				transform *= Scale(0.9,0.9);
+				break;
+			case 'S':
+				transform *= Scale(1/0.9,1/0.9);
+				break;
+			case 'h':
+				transform *= Scale(0.9,1);
+				break;
+			case 'H':
+				transform *= Scale(1/0.9,1);
+				break;
+			case 'v':
+				transform *= Scale(1,0.9);
+				break;
+			case 'V':
+				transform *= Scale(1,1/0.9);
+				break;
+			case '[':
+				t_stack.push(transform);
+				break;
+			case ']':
+				transform = t_stack.top();
+				t_stack.pop();
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+//The same with Affine2 (or Affine2d, Affine2x), composed in place (as
+//A3Canvas::draw did before the action table)
+template<class T>
+static void InterpretAffine2(const string& s, vector< BasicAffine2<T> >& out){
+	stack< BasicAffine2<T> > t_stack;
+	BasicAffine2<T> transform;
+	const T rot_c = T(cos(M_PI/6)), rot_s = T(sin(M_PI/6));
+	out.clear();
+	for (unsigned int j = 0; j < s.size(); j++){
+		switch(s[j]){
+			case 'L':
+				out.push_back(transform);
+				break;
+			case 'T':
+				out.push_back(transform);
+				transform.translate(0,6);
+				break;
+			case '+':
+				transform.rotate(rot_c,rot_s);
+				break;
+			case '-':
+				transform.rotate(rot_c,-rot_s);
+				break;
+			case 's':
+				transform.scale(0.9,0.9);
+				break;
+			case 'S':
+				transform.scale(1/0.9,1/0.9);
+				break;
+			case 'h':
+				transform.scale(0.9,1);
+				break;
+			case 'H':
+				transform.scale(1/0.9,1);
+				break;
+			case 'v':
+				transform.scale(1,0.9);
+				break;
+			case 'V':
+				transform.scale(1,1/0.9);
+				break;
+			case '[':
+				t_stack.push(transform);
+				break;
+			case ']':
+				transform = t_stack.top();
+				t_stack.pop();
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+//Per-symbol cost of following the turtle through the generated string
+//(the last two cases also record bounds and branch records for culling,
+//which the first two don't)
+static void BenchTurtle(LSystem* L, int iterations){
+	TurtleInterpreter turtle;
+	string error;
+	if (!turtle.Configure(L->GetDirectives(), error))
+		printf("(Ignoring bad directive: %s)\n", error.c_str());
+	string s = L->GenerateSystemString(iterations);
+	printf("Turtle (%lu symbols, %d iterations)\n", (unsigned long)s.size(), iterations);
+
+	vector<Matrix3> transforms;
+	Report("Matrix3 products (before Affine2)", Time(s.size(), [&]{
+		InterpretMatrix3(s, transforms);
+	}), "symbol");
+	vector<Affine2> affines;
+	Report("Affine2 in place", Time(s.size(), [&]{
+		InterpretAffine2(s, affines);
+	}), "symbol");
+	TurtleGeometry geometry;
+	Report("Action table, per symbol", Time(s.size(), [&]{
+		turtle.Interpret(s, geometry);
+	}), "symbol");
+	//What LSViewer does: generate compiled (fused) actions and interpret
+	//those (still reported per symbol of the string)
+	TurtleProgram program;
+	turtle.Compile(*L, program);
+	vector<TurtleAction> ops;
+	turtle.Generate(program, iterations, ops);
+	Report("Compiled actions", Time(s.size(), [&]{
+		turtle.Interpret(ops, geometry);
+	}), "symbol");
+	bench_sink = transforms.size() + affines.size() + geometry.primitives.size();
+}
+
+//Matrix3 chains evaluated eagerly (a temporary matrix per product, as
+//GeneralMatrix::MatMult does) against the expression templates (one row of
+//scratch space per product, and no temporary for M *= R). The aliased cases
+//go through a temporary, so they show what that costs.
+static void BenchMatrixChains(){
+	const int n = 256;
+	vector<Matrix3> A(n), B(n), C(n), out(n);
+	for (int i = 0; i < n; i++){
+		A[i] = Matrix3(1, 0.5f*i, 2, 0, 1, -i, 0, 0, 1);
+		B[i] = Rotation(0.01f*i);
+		C[i] = Scale(1 + 0.001f*i, 0.9f);
+		out[i].identity();
+	}
+	printf("Matrix3 chains (%d per run)\n", n);
+	Report("Eager, out = A*B*C", Time(n, [&]{
+		for (int i = 0; i < n; i++){
+			Matrix3 AB;
+			Matrix3::MatMult(A[i], B[i], AB);
+			Matrix3::MatMult(AB, C[i], out[i]);
+		}
+	}), "matrix");
+	Report("Expression, out = A*B*C", Time(n, [&]{
+		for (int i = 0; i < n; i++)
+			out[i] = A[i]*B[i]*C[i];
+	}), "matrix");
+	Report("Eager, M = M*R", Time(n, [&]{
+		for (int i = 0; i < n; i++){
+			Matrix3 M;
+			Matrix3::MatMult(out[i], B[i], M);
+			out[i] = M;
+		}
+	}), "matrix");
+	Report("Expression, M *= R (in place)", Time(n, [&]{
+		for (int i = 0; i < n; i++)
+			out[i] *= B[i];
+	}), "matrix");
+	Report("Expression, M = A*M (aliased)", Time(n, [&]{
+		for (int i = 0; i < n; i++)
+			out[i] = B[i]*out[i];
+	}), "matrix");
+	Report("Expression, M = A + M (aliased)", Time(n, [&]{
+		for (int i = 0; i < n; i++)
+			out[i] = A[i] + out[i];
+	}), "matrix");
+	//(The last case made the entries grow; check the aliased forms against
+	//distinct matrices as well)
+	Matrix3 M = B[1], expected = A[1]*B[1] + B[1];
+	M = A[1]*M + M;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			if (M(i,j) != expected(i,j))
+				printf("  M = A*M + M differs from the unaliased result at (%d,%d)\n", i, j);
+	bench_sink = out[n/2](0,0);
+}
+
+//Matrix products by rows, with the scalar loop and with the SSE row
+//kernels which MultiplyRow uses for 3x3 and 4x4 float operands
+template<int n>
+static void BenchMultiplyRow(){
+	const int count = 256;
+	vector< GeneralMatrix<n,n> > left(count), right(count), out(count);
+	for (int i = 0; i < count; i++)
+		for (int r = 0; r < n; r++)
+			for (int c = 0; c < n; c++){
+				left[i](r,c) = (float)((i + 3*r + c)%7) - 3;
+				right[i](r,c) = (float)((i + r + 5*c)%11)*0.25f;
+			}
+	printf("%dx%d products by rows (%d per run)\n", n, n, count);
+	Report("Scalar rows", Time(count, [&]{
+		for (int i = 0; i < count; i++)
+			for (int r = 0; r < n; r++)
+				MultiplyRowScalar(left[i].Row(r), right[i], &out[i](r,0));
+	}), "matrix");
+#if MATRIX_SIMD
+	Report("SSE rows", Time(count, [&]{
+		for (int i = 0; i < count; i++)
+			for (int r = 0; r < n; r++)
+				SimdMultiplyRow(left[i].Row(r), right[i], &out[i](r,0));
+	}), "matrix");
+	//(Both add the terms in the same order)
+	for (int i = 0; i < count; i++)
+		for (int r = 0; r < n; r++){
+			float scalar[n];
+			MultiplyRowScalar(left[i].Row(r), right[i], scalar);
+			for (int c = 0; c < n; c++)
+				if (scalar[c] != out[i](r,c))
+					printf("  SSE row %d of product %d differs from the scalar loop\n", r, i);
+		}
+#endif
+	bench_sink = out[count/2](0,0);
+}
+
+//Transforming polygon vertices to rounded screen coordinates, as
+//TransformedRenderer does for every leaf and stem: n points per call
+//(leaves have a handful of points, so the small case is the usual one)
+static void BenchPoints(int n){
+	const int total = 1 << 16;
+	vector<float> x(total), y(total);
+	vector<int16_t> out_x(total), out_y(total);
+	for (int i = 0; i < total; i++){
+		x[i] = (float)(i%97) - 48;
+		y[i] = (float)(i%89)*0.5f;
+	}
+	Affine2 T(3.1f, 0.4f, 400.5f, -0.4f, -3.1f, 600.25f);
+	Matrix3 M = T.ToMatrix3();
+	printf("Points (%d per call)\n", n);
+
+	//The old TransformedRenderer::TransformVector, one point at a time
+	Report("Matrix3 * Vector3", Time(total, [&]{
+		for (int i = 0; i < total; i++){
+			Vector3 V = M*Vector3(x[i],y[i],1);
+			out_x[i] = (int16_t)roundf(V.x());
+			out_y[i] = (int16_t)roundf(V.y());
+		}
+	}), "point");
+	Report("Affine2, scalar", Time(total, [&]{
+		for (int i = 0; i < total; i += n)
+			TransformPointsRoundedScalar(T, &x[i], &y[i], &out_x[i], &out_y[i], 0, n);
+	}), "point");
+#if MATRIX_SIMD
+	Report("Affine2, SSE2", Time(total, [&]{
+		for (int i = 0; i < total; i += n)
+			TransformPointsRounded_SSE2(T, &x[i], &y[i], &out_x[i], &out_y[i], n);
+	}), "point");
+	if (CPUHasAVX2())
+		Report("Affine2, AVX2", Time(total, [&]{
+			for (int i = 0; i < total; i += n)
+				TransformPointsRounded_AVX2(T, &x[i], &y[i], &out_x[i], &out_y[i], n);
+		}), "point");
+#endif
+	Report("Affine2::TransformPointsRounded", Time(total, [&]{
+		for (int i = 0; i < total; i += n)
+			T.TransformPointsRounded(&x[i], &y[i], &out_x[i], &out_y[i], n);
+	}), "point");
+	bench_sink = out_x[total/2] + out_y[total/3];
+}
+
+//float against double against 16.16 fixed point: the cost of following
+//the turtle and transforming points, and how far each drifts over a long
+//chain of compositions
+template<class T>
+static double Drift(int steps){
+	//Compose rotations by one radian and compare with a single rotation
+	//by the whole angle
+	BasicAffine2<T> R = BasicAffine2<T>::Rotation(1), transform;
+	for (int i = 0; i < steps; i++)
+		transform *= R;
+	Affine2d exact = Affine2d::Rotation(fmod((double)steps, 2*M_PI));
+	typedef ScalarTraits<T> S;
+	return fabs(S::ToDouble(transform.m00) - exact.m00) + fabs(S::ToDouble(transform.m01) - exact.m01)
+		+ fabs(S::ToDouble(transform.m10) - exact.m10) + fabs(S::ToDouble(transform.m11) - exact.m11);
+}
+template<class T>
+static void BenchScalarType(const string& s){
+	typedef ScalarTraits<T> S;
+	char name[64];
+	vector< BasicAffine2<T> > affines;
+	snprintf(name, sizeof(name), "Turtle, %s", S::Name());
+	Report(name, Time(s.size(), [&]{
+		InterpretAffine2(s, affines);
+	}), "symbol");
+
+	const int n = 1024;
+	vector<float> x(n), y(n);
+	vector<int16_t> out_x(n), out_y(n);
+	for (int i = 0; i < n; i++){
+		x[i] = (float)(i%97) - 48;
+		y[i] = (float)(i%89)*0.5f;
+	}
+	BasicAffine2<T> M(Affine2d(3.1, 0.4, 400.5, -0.4, -3.1, 600.25));
+	snprintf(name, sizeof(name), "Points, %s", S::Name());
+	Report(name, Time(n, [&]{
+		M.TransformPointsRounded(&x[0], &y[0], &out_x[0], &out_y[0], n);
+	}), "point");
+	bench_sink = affines.size() + out_x[n/2];
+}
+static void BenchScalarTypes(LSystem* L, int iterations){
+	string s = L->GenerateSystemString(iterations);
+	printf("Scalar types\n");
+	BenchScalarType<float>(s);
+	BenchScalarType<double>(s);
+	BenchScalarType<Fixed16>(s);
+
+	//Affine2x with the points already in fixed point (integer only)
+	const int n = 1024;
+	vector<Fixed16> x(n), y(n);
+	vector<int16_t> out_x(n), out_y(n);
+	for (int i = 0; i < n; i++){
+		x[i] = Fixed16(i%97 - 48);
+		y[i] = Fixed16((i%89)*0.5);
+	}
+	Affine2x M(Affine2d(3.1, 0.4, 400.5, -0.4, -3.1, 600.25));
+	Report("Points, fixed16.16 from fixed16.16", Time(n, [&]{
+		TransformPointsRounded(M, &x[0], &y[0], &out_x[0], &out_y[0], n);
+	}), "point");
+	bench_sink = out_x[n/2];
+
+	for (int steps = 100; steps <= 1000000; steps *= 100)
+		printf("  Error after %7d compositions: float %.3g, double %.3g, fixed %.3g\n",
+			steps, Drift<float>(steps), Drift<double>(steps), Drift<Fixed16>(steps));
+}
+
+//Overhead of a small ParallelFor (like A3Canvas::place_forest's, once per
+//frame) against starting and joining threads for every loop
+static void ParallelForSpawn(int n, int threads, const std::function<void(int)>& f){
+	std::atomic<int> next(0);
+	auto work = [&](){
+		int i;
+		while ((i = next++) < n)
+			f(i);
+	};
+	vector<thread> workers;
+	for (int i = 1; i < min(threads, n); i++)
+		workers.push_back(thread(work));
+	work();
+	for (unsigned int i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+static void BenchParallelFor(int n, int threads){
+	printf("ParallelFor (%d pieces, %d threads)\n", n, threads);
+	vector<int> out(n);
+	auto f = [&](int i){ out[i] = i; };
+	const int loops = 200;
+	Report("Threads started per loop", Time(loops, [&]{
+		for (int i = 0; i < loops; i++)
+			ParallelForSpawn(n, threads, f);
+	}), "loop");
+	Report("Persistent pool", Time(loops, [&]{
+		for (int i = 0; i < loops; i++)
+			ParallelFor(n, threads, f);
+	}), "loop");
+	bench_sink = out[n - 1];
+}
+
+
+int main(int argc, char** argv){
+	string filename = argc > 1? argv[1]: "tests/sample_tree2.txt";
+	int iterations = argc > 2? atoi(argv[2]): 10;
+	LSystem* L = LSystem::ParseFile(filename);
+	if (!L){
+		fprintf(stderr, "Unable to parse %s\n", filename.c_str());
+		return 1;
+	}
+	BenchTurtle(L, iterations);
+	BenchMatrixChains();
+	BenchMultiplyRow<3>();
+	BenchMultiplyRow<4>();
+	BenchPoints(8);
+	BenchPoints(1024);
+	BenchScalarTypes(L, iterations);
+	BenchParallelFor(4, 4);
+	delete L;
+	return 0;
+}
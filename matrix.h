@@ -12,78 +12,267 @@
 #define MATRIX_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <type_traits>
+
+//SIMD kernels are used on x86 with GCC/Clang (SSE2 is always available on
+//x86-64; AVX2 is detected at runtime). Everything else uses plain loops.
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define MATRIX_SIMD 1
+#include <immintrin.h>
+#else
+#define MATRIX_SIMD 0
+#endif
+
+#if defined(__GNUC__)
+#define MATRIX_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#else
+#define MATRIX_CONSTANT_EVALUATED() false
+#endif
+
+//Compile-time sine and cosine (Taylor series, accurate to about double
+//precision after range reduction), so that rotation tables can be
+//built as constexpr data.
+constexpr double ConstSin(double x){
+	const double pi = 3.14159265358979323846;
+	while (x > pi)
+		x -= 2*pi;
+	while (x < -pi)
+		x += 2*pi;
+	double term = x, sum = x;
+	for (int i = 1; i < 20; i++){
+		term *= -x*x/((2*i)*(2*i+1));
+		sum += term;
+	}
+	return sum;
+}
+constexpr double ConstCos(double x){
+	return ConstSin(x + 3.14159265358979323846/2);
+}
+
+//A signed 16.16 fixed-point number, usable as the entry type of the
+//matrix classes below. Products are rounded to the nearest 1/65536.
+//Conversions and arithmetic saturate at the ends of the range (just
+//under +-32768) rather than wrapping; NaN converts to the largest value,
+//as in RoundToInt16.
+class Fixed16{
+public:
+	static const int FRACTION_BITS = 16;
+	static const int32_t ONE = 1 << FRACTION_BITS;
+	static const int32_t RAW_MAX = INT32_MAX;
+	static const int32_t RAW_MIN = INT32_MIN;
+	
+	constexpr Fixed16(): raw(0){ }
+	constexpr Fixed16(int v): raw(v > 32767? RAW_MAX: v < -32768? RAW_MIN: v*ONE){ }
+	constexpr Fixed16(float v): raw(RawFromDouble(v)){ }
+	constexpr Fixed16(double v): raw(RawFromDouble(v)){ }
+	static constexpr Fixed16 FromRaw(int32_t r){
+		Fixed16 f;
+		f.raw = r;
+		return f;
+	}
+	constexpr int32_t Raw() const{ return raw; }
+	explicit constexpr operator float() const{ return raw/(float)ONE; }
+	explicit constexpr operator double() const{ return raw/(double)ONE; }
+	//Round to the nearest integer (halfway cases away from zero)
+	constexpr int32_t RoundToInt() const{
+		return raw >= 0? (int32_t)(((int64_t)raw + ONE/2) >> FRACTION_BITS): -(int32_t)((-(int64_t)raw + ONE/2) >> FRACTION_BITS);
+	}
+	
+	constexpr Fixed16 operator -() const{ return FromRaw(Saturate(-(int64_t)raw)); }
+	constexpr Fixed16 operator +(Fixed16 o) const{ return FromRaw(Saturate((int64_t)raw + o.raw)); }
+	constexpr Fixed16 operator -(Fixed16 o) const{ return FromRaw(Saturate((int64_t)raw - o.raw)); }
+	constexpr Fixed16 operator *(Fixed16 o) const{
+		return FromRaw(Saturate(((int64_t)raw*o.raw + ONE/2) >> FRACTION_BITS));
+	}
+	constexpr Fixed16 operator /(Fixed16 o) const{ //(Division by zero saturates)
+		if (o.raw == 0)
+			return FromRaw(raw >= 0? RAW_MAX: RAW_MIN);
+		return FromRaw(Saturate((int64_t)raw*ONE/o.raw));
+	}
+	constexpr Fixed16& operator +=(Fixed16 o){ return *this = *this + o; }
+	constexpr Fixed16& operator -=(Fixed16 o){ return *this = *this - o; }
+	constexpr Fixed16& operator *=(Fixed16 o){ return *this = *this * o; }
+	constexpr Fixed16& operator /=(Fixed16 o){ return *this = *this / o; }
+	constexpr bool operator ==(Fixed16 o) const{ return raw == o.raw; }
+	constexpr bool operator !=(Fixed16 o) const{ return raw != o.raw; }
+	constexpr bool operator <(Fixed16 o) const{ return raw < o.raw; }
+	constexpr bool operator >(Fixed16 o) const{ return raw > o.raw; }
+	constexpr bool operator <=(Fixed16 o) const{ return raw <= o.raw; }
+	constexpr bool operator >=(Fixed16 o) const{ return raw >= o.raw; }
+private:
+	static constexpr int32_t Saturate(int64_t r){
+		return r > RAW_MAX? RAW_MAX: r < RAW_MIN? RAW_MIN: (int32_t)r;
+	}
+	static constexpr int32_t RawFromDouble(double v){
+		double r = v*ONE;
+		if (!(r < RAW_MAX + 0.5))
+			return RAW_MAX;
+		if (r <= RAW_MIN - 0.5)
+			return RAW_MIN;
+		return (int32_t)(r + (r < 0? -0.5: 0.5));
+	}
+	int32_t raw;
+};
+
+static_assert(Fixed16(40000).Raw() == Fixed16::RAW_MAX && Fixed16(-1e9).Raw() == Fixed16::RAW_MIN
+	&& (Fixed16(30000) + Fixed16(30000)).Raw() == Fixed16::RAW_MAX
+	&& (Fixed16(-300)*Fixed16(300)).Raw() == Fixed16::RAW_MIN
+	&& Fixed16(NAN).Raw() == Fixed16::RAW_MAX && Fixed16(-2.5).RoundToInt() == -3,
+	"Fixed16 should saturate rather than wrap");
+
+//Per-scalar-type helpers used by the templates below
+template<class T>
+struct ScalarTraits{
+	static double ToDouble(T v){ return (double)v; }
+	static const char* Name(){ return "?"; }
+};
+template<> struct ScalarTraits<float>{
+	static double ToDouble(float v){ return v; }
+	static const char* Name(){ return "float"; }
+};
+template<> struct ScalarTraits<double>{
+	static double ToDouble(double v){ return v; }
+	static const char* Name(){ return "double"; }
+};
+template<> struct ScalarTraits<Fixed16>{
+	static double ToDouble(Fixed16 v){ return (double)v; }
+	static const char* Name(){ return "fixed16.16"; }
+};
+
+//Expression templates
+//Arithmetic on matrices (+, * and scalar *) does not compute anything
+//immediately: it builds a small expression object which is evaluated when it
+//is assigned to (or used to construct) a matrix. Products are evaluated one
+//row at a time, so a chain like A*B*C*v needs a single row of scratch space
+//rather than a temporary matrix per operator, and in-place operations like
+//M *= R write straight into M.
+//Expressions hold references to the matrices they were built from, so they
+//must be evaluated before the end of the full expression that created them
+//(i.e. don't store them in 'auto' variables).
+//If the destination of an assignment appears anywhere in the expression
+//(e.g. M = A + M or M = A*M), the expression is evaluated into a temporary
+//first, since writing the result row by row would overwrite entries that
+//are still needed.
+template<class E, int m, int n, class T>
+class MatrixExpression{
+public:
+	typedef T EntryType;
+	static const int numRows = m;
+	static const int numCols = n;
+	constexpr const E& derived() const{
+		return static_cast<const E&>(*this);
+	}
+	//Compute row i of the result into out[0..n-1]
+	constexpr void EvalRow(int i, EntryType* out) const{
+		derived().EvalRow(i,out);
+	}
+	constexpr EntryType GetEntry(int row,int col) const{
+		return derived().GetEntry(row,col);
+	}
+	//True if the matrix at address p appears anywhere in the expression
+	constexpr bool References(const void* p) const{
+		return derived().References(p);
+	}
+};
 
 //A generalized m row, n column matrix
 //Stored in row major order
-template<int m, int n> 
-class GeneralMatrix{
+//T is the type of the entries (float by default; double and Fixed16 are
+//also supported)
+template<int m, int n, class T = float> 
+class GeneralMatrix: public MatrixExpression<GeneralMatrix<m,n,T>,m,n,T>{
 public:
-	typedef float EntryType;
+	typedef T EntryType;
 	
 	static const int numRows = m;
 	static const int numCols = n;
 
-	GeneralMatrix(){
-		setzero();
-	}
+	//The matrix types have no reference members or user-defined copy
+	//operations, so they are trivially copyable and usable in constexpr
+	//expressions.
+	constexpr GeneralMatrix(): entries(){ }
 	//Create a matrix from a (row-major) array
-	GeneralMatrix(EntryType Entries[m][n]){
-		int i,j;
+	constexpr GeneralMatrix(const EntryType Entries[m][n]): entries(){
+		int i = 0, j = 0;
 		for (i = 0; i < m; i++)
 			for(j = 0; j < n; j++)
 				Entry(i,j) = Entries[i][j];
 	}
 	
 	//Create a matrix from a pointer to a (row or column major) array with stride bytes between the beginning of each row (or column if column major is used)
-	GeneralMatrix(EntryType *Entries,int stride,bool rowMajor = true){
-		int i,j;
+	constexpr GeneralMatrix(const EntryType *Entries,int stride,bool rowMajor = true): entries(){
+		int i = 0, j = 0;
 		for (i = 0; i < m; i++)
 			for(j = 0; j < n; j++)
 				Entry(i,j) = rowMajor? Entries[i*stride+j]: Entries[j*stride+i];
 	}
 	
-	//Copy Constructors
-	GeneralMatrix(const GeneralMatrix<m,n> &other){ 
-		int i,j;
-		for (i = 0; i < m; i++)
-			for( j = 0; j < n; j++)
-				Entry(i,j) = other.GetEntry(i,j);		
+	//Evaluate an expression (e.g. GeneralMatrix<3,3> M = A*B*C)
+	template<class E>
+	constexpr GeneralMatrix(const MatrixExpression<E,m,n,T>& expr): entries(){
+		Assign(expr);
+	}
+	template<class E>
+	constexpr GeneralMatrix<m,n,T>& operator=(const MatrixExpression<E,m,n,T>& expr){
+		Assign(expr);
+		return *this;
 	}
-	GeneralMatrix<m,n>& operator=(const GeneralMatrix<m,n>& other){
-		int i,j;
+	template<class E>
+	constexpr void Assign(const MatrixExpression<E,m,n,T>& expr){
+		//Go through a temporary if the expression refers to this matrix
+		//(address comparisons aren't allowed in constant expressions, so
+		//always do so there)
+		if (MATRIX_CONSTANT_EVALUATED() || expr.References(this)){
+			GeneralMatrix<m,n,T> tmp;
+			tmp.EvalRows(expr);
+			*this = tmp;
+		}else
+			EvalRows(expr);
+	}
+	template<class E>
+	constexpr void EvalRows(const MatrixExpression<E,m,n,T>& expr){
+		int i = 0;
 		for (i = 0; i < m; i++)
-			for( j = 0; j < n; j++)
-				Entry(i,j) = other.GetEntry(i,j);	
-		return *this;
+			expr.EvalRow(i,entries[i]);
+	}
+	
+	//Expression interface
+	constexpr void EvalRow(int i, EntryType* out) const{
+		int j = 0;
+		for (j = 0; j < n; j++)
+			out[j] = entries[i][j];
+	}
+	constexpr bool References(const void* p) const{
+		return p == this;
 	}
 	
-	void setzero(){
-		int i,j;
+	constexpr void setzero(){
+		int i = 0, j = 0;
 		for (i = 0; i < m; i++)
 			for (j = 0; j < n; j++)
 				Entry(i,j) = 0;
 	}
 	
-	EntryType& operator()(int row,int col){
+	constexpr EntryType& operator()(int row,int col){
+		return entries[row][col];
+	}
+	constexpr EntryType operator()(int row,int col) const{
 		return entries[row][col];
 	}
-	EntryType& Entry(int row,int col){
+	constexpr EntryType& Entry(int row,int col){
 		return (*this)(row,col);
 	}
-	EntryType GetEntry(int row,int col) const{
-		return (*const_cast<GeneralMatrix<m,n>* >(this))(row,col);
+	constexpr EntryType GetEntry(int row,int col) const{
+		return entries[row][col];
 	}
-	
-	GeneralMatrix<m,n> operator * (EntryType s) const{ //Multiply by scalar
-		GeneralMatrix<m,n> ret;
-		int i,j;
-		for (i = 0; i < m; i++)
-			for (j = 0; j < n; j++)
-				ret(i,j) = this->GetEntry(i,j)*s;
-		return ret;
+	constexpr const EntryType* Row(int row) const{
+		return entries[row];
 	}
-	GeneralMatrix<m,n>& operator *= (EntryType s){ //Multiply by scalar (in place)
-		int i,j;
+	
+	constexpr GeneralMatrix<m,n,T>& operator *= (EntryType s){ //Multiply by scalar (in place)
+		int i = 0, j = 0;
 		for (i = 0; i < m; i++)
 			for (j = 0; j < n; j++)
 				Entry(i,j) *= s;
@@ -91,32 +280,15 @@ public:
 	}
 	
 	
-	template<class T>
-	T operator + (const T& mat2) const{ //Add Matrix
-		T ret;
-		int i,j;
-		for (i = 0; i < m; i++)
-			for (j = 0; j < n; j++)
-				ret.Entry(i,j) += this->GetEntry(i,j)+mat2.GetEntry(i,j);
-		return ret;
+	template<class E>
+	constexpr GeneralMatrix<m,n,T>& operator += (const MatrixExpression<E,m,n,T>& other){ //Add Matrix (in place)
+		return *this = *this + other;
 	}
 	
-	GeneralMatrix<m,n>& operator += (GeneralMatrix<m,n>& other){ //Add Matrix (in place)
-		int i,j;
-		for (i = 0; i < m; i++)
-			for (j = 0; j < n; j++)
-				entries[i][j] *= other.entries[i][j];
-		return *this;
-	}
-	template<int p>
-	GeneralMatrix<m,p> operator * (const GeneralMatrix<n,p>& mat2) const{ //Multiply
-		GeneralMatrix<m,p> ret;
-		MatMult(*this,mat2,ret);
-		return ret;
-	}
+	//Eager multiplication (the * operator builds an expression instead)
 	template<int p>
-	static void MatMult(const GeneralMatrix<m,n>& mat1, const GeneralMatrix<n,p>& mat2, GeneralMatrix<m,p>& out){
-		int i,j,k;
+	static constexpr void MatMult(const GeneralMatrix<m,n,T>& mat1, const GeneralMatrix<n,p,T>& mat2, GeneralMatrix<m,p,T>& out){
+		int i = 0, j = 0, k = 0;
 		for (i = 0; i < m; i++)
 			for (j = 0; j < p; j++){
 				EntryType sum = 0;
@@ -126,11 +298,11 @@ public:
 			}
 	}
 	
-	void print(){
-		int i,j;
+	void print() const{
+		int i = 0, j = 0;
 		for (i = 0; i < m; i++){
 			for (j = 0; j < n; j++)
-				printf("%.2f ",Entry(i,j));
+				printf("%.2f ",ScalarTraits<T>::ToDouble(GetEntry(i,j)));
 			printf("\n");
 		}
 		printf("\n");
@@ -142,34 +314,210 @@ protected:
 };
 
 
-template<int n>
-class Vector: public GeneralMatrix<n,1>{
+template<class L, class R, int m, int k, int n, class T> class MatrixProduct;
+template<class L, class R, int m, int n, class T> class MatrixSum;
+template<class E, int m, int n, class T> class MatrixScaled;
+
+//How an expression node holds its operands: matrices by reference,
+//other expression nodes (which are just a few references) by value
+template<class E>
+struct ExpressionOperand{
+	typedef const E& type;
+};
+template<class L, class R, int m, int k, int n, class T>
+struct ExpressionOperand< MatrixProduct<L,R,m,k,n,T> >{
+	typedef MatrixProduct<L,R,m,k,n,T> type;
+};
+template<class L, class R, int m, int n, class T>
+struct ExpressionOperand< MatrixSum<L,R,m,n,T> >{
+	typedef MatrixSum<L,R,m,n,T> type;
+};
+template<class E, int m, int n, class T>
+struct ExpressionOperand< MatrixScaled<E,m,n,T> >{
+	typedef MatrixScaled<E,m,n,T> type;
+};
+
+#if MATRIX_SIMD
+//SSE versions of MultiplyRow for the common 3x3 and 4x4 cases: the result
+//row is accumulated as row[0]*right.Row(0) + row[1]*right.Row(1) + ...
+//with one broadcast and one multiply-add per row of the right operand.
+//The sums are added in the same order as the scalar loop, so the results
+//are identical.
+//(Returns false if there is no SIMD version for the operand type)
+template<class T, class R>
+inline bool SimdMultiplyRow(const T* row, const R& right, T* out){
+	return false;
+}
+inline bool SimdMultiplyRow(const float* row, const GeneralMatrix<4,4>& right, float* out){
+	__m128 sum = _mm_mul_ps(_mm_set1_ps(row[0]), _mm_loadu_ps(right.Row(0)));
+	sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[1]), _mm_loadu_ps(right.Row(1))));
+	sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[2]), _mm_loadu_ps(right.Row(2))));
+	sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[3]), _mm_loadu_ps(right.Row(3))));
+	_mm_storeu_ps(out, sum);
+	return true;
+}
+inline bool SimdMultiplyRow(const float* row, const GeneralMatrix<3,3>& right, float* out){
+	//Rows 0 and 1 can be loaded as 4 floats (the 4th lane is the first entry
+	//of the next row, which is ignored); row 2 is the end of the matrix
+	const float* r2 = right.Row(2);
+	__m128 sum = _mm_mul_ps(_mm_set1_ps(row[0]), _mm_loadu_ps(right.Row(0)));
+	sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[1]), _mm_loadu_ps(right.Row(1))));
+	sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[2]), _mm_setr_ps(r2[0], r2[1], r2[2], 0)));
+	_mm_storel_pi((__m64*)out, sum);
+	_mm_store_ss(out + 2, _mm_movehl_ps(sum, sum));
+	return true;
+}
+#endif
+
+//out = row * right, where row has k entries
+template<class R, int k, int n, class T>
+constexpr void MultiplyRowScalar(const T* row, const MatrixExpression<R,k,n,T>& right, T* out){
+	int j = 0, l = 0;
+	for (j = 0; j < n; j++){
+		T sum = 0;
+		for (l = 0; l < k; l++)
+			sum += row[l]*right.GetEntry(l,j);
+		out[j] = sum;
+	}
+}
+//The same, with the SSE version where there is one (like the point
+//kernels below, SSE2 is the baseline on x86-64 and needs no runtime check)
+template<class R, int k, int n, class T>
+constexpr void MultiplyRow(const T* row, const MatrixExpression<R,k,n,T>& right, T* out){
+#if MATRIX_SIMD
+	if (!MATRIX_CONSTANT_EVALUATED() && SimdMultiplyRow(row, right.derived(), out))
+		return;
+#endif
+	MultiplyRowScalar(row, right, out);
+}
+
+//(m x k) * (k x n)
+template<class L, class R, int m, int k, int n, class T>
+class MatrixProduct: public MatrixExpression<MatrixProduct<L,R,m,k,n,T>,m,n,T>{
+public:
+	typedef T EntryType;
+	constexpr MatrixProduct(const L& left, const R& right): left(left), right(right){ }
+	constexpr void EvalRow(int i, EntryType* out) const{
+		EntryType row[k] = {};
+		left.EvalRow(i,row);
+		MultiplyRow(row,right,out);
+	}
+	constexpr EntryType GetEntry(int row,int col) const{
+		EntryType sum = 0;
+		int l = 0;
+		for (l = 0; l < k; l++)
+			sum += left.GetEntry(row,l)*right.GetEntry(l,col);
+		return sum;
+	}
+	constexpr bool References(const void* p) const{
+		return left.References(p) || right.References(p);
+	}
+private:
+	typename ExpressionOperand<L>::type left;
+	typename ExpressionOperand<R>::type right;
+};
+
+template<class L, class R, int m, int n, class T>
+class MatrixSum: public MatrixExpression<MatrixSum<L,R,m,n,T>,m,n,T>{
+public:
+	typedef T EntryType;
+	constexpr MatrixSum(const L& left, const R& right): left(left), right(right){ }
+	constexpr void EvalRow(int i, EntryType* out) const{
+		EntryType row[n] = {};
+		int j = 0;
+		left.EvalRow(i,out);
+		right.EvalRow(i,row);
+		for (j = 0; j < n; j++)
+			out[j] += row[j];
+	}
+	constexpr EntryType GetEntry(int row,int col) const{
+		return left.GetEntry(row,col) + right.GetEntry(row,col);
+	}
+	constexpr bool References(const void* p) const{
+		return left.References(p) || right.References(p);
+	}
+private:
+	typename ExpressionOperand<L>::type left;
+	typename ExpressionOperand<R>::type right;
+};
+
+template<class E, int m, int n, class T>
+class MatrixScaled: public MatrixExpression<MatrixScaled<E,m,n,T>,m,n,T>{
 public:
-	typedef typename GeneralMatrix<n,1>::EntryType EntryType;
-	Vector(): GeneralMatrix<n,1>(){}
-	Vector(EntryType Entries[n]): GeneralMatrix<n,1>( Entries,1,true ){}
-	EntryType DotProduct(const Vector<n>& other) const{
+	typedef T EntryType;
+	constexpr MatrixScaled(const E& inner, EntryType s): inner(inner), s(s){ }
+	constexpr void EvalRow(int i, EntryType* out) const{
+		int j = 0;
+		inner.EvalRow(i,out);
+		for (j = 0; j < n; j++)
+			out[j] *= s;
+	}
+	constexpr EntryType GetEntry(int row,int col) const{
+		return inner.GetEntry(row,col)*s;
+	}
+	constexpr bool References(const void* p) const{
+		return inner.References(p);
+	}
+private:
+	typename ExpressionOperand<E>::type inner;
+	EntryType s;
+};
+
+template<class L, class R, int m, int k, int n, class T>
+constexpr MatrixProduct<L,R,m,k,n,T> operator *(const MatrixExpression<L,m,k,T>& left, const MatrixExpression<R,k,n,T>& right){ //Multiply
+	return MatrixProduct<L,R,m,k,n,T>(left.derived(),right.derived());
+}
+template<class L, class R, int m, int n, class T>
+constexpr MatrixSum<L,R,m,n,T> operator +(const MatrixExpression<L,m,n,T>& left, const MatrixExpression<R,m,n,T>& right){ //Add Matrix
+	return MatrixSum<L,R,m,n,T>(left.derived(),right.derived());
+}
+template<class E, int m, int n, class T>
+constexpr MatrixScaled<E,m,n,T> operator *(const MatrixExpression<E,m,n,T>& mat, typename std::common_type<T>::type s){ //Multiply by scalar
+	return MatrixScaled<E,m,n,T>(mat.derived(),s);
+}
+
+
+template<int n, class T = float>
+class Vector: public GeneralMatrix<n,1,T>{
+public:
+	typedef typename GeneralMatrix<n,1,T>::EntryType EntryType;
+	constexpr Vector(): GeneralMatrix<n,1,T>(){}
+	constexpr Vector(const EntryType Entries[n]): GeneralMatrix<n,1,T>( Entries,1,true ){}
+	constexpr Vector(const GeneralMatrix<n,1,T>& other): GeneralMatrix<n,1,T>(other){}
+	template<class E>
+	constexpr Vector(const MatrixExpression<E,n,1,T>& expr): GeneralMatrix<n,1,T>(expr){}
+	//(The implicit copy assignment would otherwise hide the expression assignment)
+	using GeneralMatrix<n,1,T>::operator=;
+	constexpr EntryType DotProduct(const Vector<n,T>& other) const{
 		EntryType sum = 0;
-		int i;
+		int i = 0;
 		for (i = 0; i < n; i++){
 			sum+= this->GetEntry(i,0)*other.GetEntry(i,0);
 		}
 		return sum;
 	}
-	EntryType& operator()(int i){
+	constexpr EntryType& operator()(int i){
 		return this->Entry(i,0);
 	}
+	constexpr EntryType operator()(int i) const{
+		return this->GetEntry(i,0);
+	}
 
 };
 
 
-template <int n>
-class SquareMatrix: public GeneralMatrix<n,n>{
+template <int n, class T_ = float>
+class SquareMatrix: public GeneralMatrix<n,n,T_>{
 public:
-	typedef typename GeneralMatrix<n,n>::EntryType EntryType;
-	void T(){
-		int i,j;
-		EntryType swap;
+	typedef typename GeneralMatrix<n,n,T_>::EntryType EntryType;
+	constexpr SquareMatrix(): GeneralMatrix<n,n,T_>(){}
+	constexpr SquareMatrix(const GeneralMatrix<n,n,T_>& other): GeneralMatrix<n,n,T_>(other){}
+	template<class E>
+	constexpr SquareMatrix(const MatrixExpression<E,n,n,T_>& expr): GeneralMatrix<n,n,T_>(expr){}
+	using GeneralMatrix<n,n,T_>::operator=;
+	constexpr void T(){
+		int i = 0, j = 0;
+		EntryType swap = 0;
 		for (i = 0; i < n; i++)
 			for (j = i+1; j < n; j++){
 				swap = (*this)(j,i);
@@ -177,8 +525,8 @@ public:
 				(*this)(i,j) = swap;
 			}
 	}
-	void identity(){
-		int i,j;
+	constexpr void identity(){
+		int i = 0, j = 0;
 		for (i = 0; i < n; i++)
 			for( j = 0; j < n; j++)
 				(*this)(i,j) = (i==j)?1:0;
@@ -188,40 +536,52 @@ public:
 	//(i.e. the thing on the right)
 	//That might be a matrix or an n x n vector, so we have to wave our hands and just
 	//hope a template can figure that out...
-	//Also, we use 'U' instead of 'T' for the template variable because T is a method name.
-	template<class U>
-	static inline void LeftMultiply(const SquareMatrix<n>& left, const U& right, U& out){
-		GeneralMatrix<n,n>::MatMult(left,right,out);
-	}
+	//Also, we use 'U' instead of 'T' for the template variable because T is a method name
+	//(for the same reason the entry type parameter of this class is called T_).
 	template<class U>
-	static inline void LeftMultiply(const SquareMatrix<n>& left, const U& right, SquareMatrix<n>& out){
-		GeneralMatrix<n,n>::MatMult(left,right,out);
+	static constexpr void LeftMultiply(const SquareMatrix<n,T_>& left, const U& right, U& out){
+		GeneralMatrix<n,n,T_>::MatMult(left,right,out);
 	}
 	template<class U>
-	U operator *(const U &right) const{
-		U ret;
-		LeftMultiply(*this,right,ret);
-		return ret;
+	static constexpr void LeftMultiply(const SquareMatrix<n,T_>& left, const U& right, SquareMatrix<n,T_>& out){
+		GeneralMatrix<n,n,T_>::MatMult(left,right,out);
 	}
 	
-	//Since these are square matrices, we can define in-place multiplication
-	template<class U>
-	SquareMatrix<n>& operator *=(const U &right){
-		SquareMatrix<n> tmp;
-		LeftMultiply(*this,right,tmp);
-		*this = tmp;
+	//Since these are square matrices, we can define in-place multiplication.
+	//Row i of this * right only needs row i of this, so each row is computed
+	//into a scratch row and copied back, unless right refers to this matrix
+	//(e.g. M *= M), in which case a temporary is used.
+	using GeneralMatrix<n,n,T_>::operator*=;
+	template<class E>
+	constexpr SquareMatrix<n,T_>& operator *=(const MatrixExpression<E,n,n,T_> &right){
+		if (MATRIX_CONSTANT_EVALUATED() || right.References(this)){
+			GeneralMatrix<n,n,T_>::operator=(*this * right);
+			return *this;
+		}
+		int i = 0, j = 0;
+		for (i = 0; i < n; i++){
+			EntryType row[n] = {};
+			MultiplyRow(this->entries[i],right,row);
+			for (j = 0; j < n; j++)
+				this->entries[i][j] = row[j];
+		}
 		return *this;
 	}
 };
 
-class Matrix3: public SquareMatrix<3>{
+template<class T>
+class BasicMatrix3: public SquareMatrix<3,T>{
 public:
-	typedef typename SquareMatrix<3>::EntryType EntryType;
-	Matrix3(): SquareMatrix<3>(){};
-	Matrix3(EntryType a00, EntryType a01, EntryType a02, 
+	typedef T EntryType;
+	constexpr BasicMatrix3(): SquareMatrix<3,T>(){};
+	constexpr BasicMatrix3(const GeneralMatrix<3,3,T>& other): SquareMatrix<3,T>(other){};
+	template<class E>
+	constexpr BasicMatrix3(const MatrixExpression<E,3,3,T>& expr): SquareMatrix<3,T>(expr){};
+	using SquareMatrix<3,T>::operator=;
+	constexpr BasicMatrix3(EntryType a00, EntryType a01, EntryType a02, 
 		    EntryType a10, EntryType a11, EntryType a12,
 			EntryType a20, EntryType a21, EntryType a22):
-				SquareMatrix<3>()
+				SquareMatrix<3,T>()
 			{
 		this->Entry(0,0) = a00;
 		this->Entry(0,1) = a01;
@@ -235,95 +595,422 @@ public:
 	}
 };
 
-class Matrix2: public SquareMatrix<2>{
+template<class T>
+class BasicMatrix2: public SquareMatrix<2,T>{
 public:
-	typedef typename SquareMatrix<2>::EntryType EntryType;
-	Matrix2(): SquareMatrix<2>(){};
-	Matrix2(EntryType a00, EntryType a01,
+	typedef T EntryType;
+	constexpr BasicMatrix2(): SquareMatrix<2,T>(){};
+	constexpr BasicMatrix2(const GeneralMatrix<2,2,T>& other): SquareMatrix<2,T>(other){};
+	template<class E>
+	constexpr BasicMatrix2(const MatrixExpression<E,2,2,T>& expr): SquareMatrix<2,T>(expr){};
+	using SquareMatrix<2,T>::operator=;
+	constexpr BasicMatrix2(EntryType a00, EntryType a01,
 		    EntryType a10, EntryType a11):
-				SquareMatrix<2>()
+				SquareMatrix<2,T>()
 			{
 		this->Entry(0,0) = a00;
 		this->Entry(0,1) = a01;
 		this->Entry(1,0) = a10;
 		this->Entry(1,1) = a11;
 	}
-	Matrix3 ToHomogeneousMatrix3() const{
-		return Matrix3( this->GetEntry(0,0), this->GetEntry(0,1), 0,
+	constexpr BasicMatrix3<T> ToHomogeneousMatrix3() const{
+		return BasicMatrix3<T>( this->GetEntry(0,0), this->GetEntry(0,1), 0,
 						this->GetEntry(1,0), this->GetEntry(1,1), 0,
 						0, 0, 1);
 	}
 };
 
-class Vector3: public Vector<3>{
+template<class T>
+class BasicVector3: public Vector<3,T>{
 public:
-	typedef typename Vector<3>::EntryType EntryType;
-	Vector3(): Vector<3>(), x(entries[0][0]), y(entries[1][0]), z(entries[2][0]) {}
-	Vector3(EntryType e[3]): Vector<3>(e), x(entries[0][0]), y(entries[1][0]), z(entries[2][0]){}
-	Vector3(EntryType x, EntryType y, EntryType z):  x(entries[0][0]), y(entries[1][0]), z(entries[2][0]){
+	typedef T EntryType;
+	constexpr BasicVector3(): Vector<3,T>() {}
+	constexpr BasicVector3(const EntryType e[3]): Vector<3,T>(e){}
+	constexpr BasicVector3(EntryType x, EntryType y, EntryType z): Vector<3,T>(){
 		this->Entry(0,0) = x;
 		this->Entry(1,0) = y;
 		this->Entry(2,0) = z;
 	}
-	Vector3(const GeneralMatrix<3,1>& other): x(entries[0][0]), y(entries[1][0]), z(entries[2][0]){
-		this->Entry(0,0) = other.GetEntry(0,0);
-		this->Entry(1,0) = other.GetEntry(1,0);
-		this->Entry(2,0) = other.GetEntry(2,0);
-	}
-	Vector3& operator=(const GeneralMatrix<3,1>& other){
-		*((GeneralMatrix<3,1>*)this) = other;
-		return *this;
-	}
-	Vector3& operator=(const Vector3& other){
-		x = other.x;
-		y = other.y;
-		z = other.z;
-		return *this;
-	}
-	static void CrossProduct(Vector3 &v1, Vector3 &v2, Vector3& out){
+	constexpr BasicVector3(const GeneralMatrix<3,1,T>& other): Vector<3,T>(other){}
+	template<class E>
+	constexpr BasicVector3(const MatrixExpression<E,3,1,T>& expr): Vector<3,T>(expr){}
+	using Vector<3,T>::operator=;
+	static constexpr void CrossProduct(const BasicVector3<T> &v1, const BasicVector3<T> &v2, BasicVector3<T>& out){
 		out(0) = v1(1)*v2(2) - v1(2)*v2(1);
 		out(1) = v1(2)*v2(0) - v1(0)*v2(2);
 		out(2) = v1(0)*v2(1) - v1(1)*v2(0);
 	}
-	Vector3 CrossProduct(Vector3& other){
-		Vector3 ret;
+	constexpr BasicVector3<T> CrossProduct(const BasicVector3<T>& other) const{
+		BasicVector3<T> ret;
 		CrossProduct(*this,other,ret);
 		return ret;
 	}
-	EntryType& x;
-	EntryType& y;
-	EntryType& z;
+	constexpr EntryType& x(){ return this->Entry(0,0); }
+	constexpr EntryType& y(){ return this->Entry(1,0); }
+	constexpr EntryType& z(){ return this->Entry(2,0); }
+	constexpr EntryType x() const{ return this->GetEntry(0,0); }
+	constexpr EntryType y() const{ return this->GetEntry(1,0); }
+	constexpr EntryType z() const{ return this->GetEntry(2,0); }
 };
 
-class Vector2: public Vector<2>{
+template<class T>
+class BasicVector2: public Vector<2,T>{
 public:
-	typedef typename Vector<2>::EntryType EntryType;
-	Vector2(): Vector<2>(), x(entries[0][0]), y(entries[1][0]) {};
-	Vector2(EntryType e[2]): Vector<2>(e), x(entries[0][0]), y(entries[1][0]){};
-	Vector2(EntryType x, EntryType y): x(entries[0][0]), y(entries[1][0]){
+	typedef T EntryType;
+	constexpr BasicVector2(): Vector<2,T>() {};
+	constexpr BasicVector2(const EntryType e[2]): Vector<2,T>(e){};
+	constexpr BasicVector2(EntryType x, EntryType y): Vector<2,T>(){
 		this->Entry(0,0) = x;
 		this->Entry(1,0) = y;
 	}
-	Vector2(const GeneralMatrix<2,1>& other): x(entries[0][0]), y(entries[1][0]){
-		this->Entry(0,0) = other.GetEntry(0,0);
-		this->Entry(1,0) = other.GetEntry(1,0);
+	constexpr BasicVector2(const GeneralMatrix<2,1,T>& other): Vector<2,T>(other){}
+	template<class E>
+	constexpr BasicVector2(const MatrixExpression<E,2,1,T>& expr): Vector<2,T>(expr){}
+	using Vector<2,T>::operator=;
+	constexpr BasicVector3<T> ToHomogeneousVector3() const{
+		return BasicVector3<T>(this->GetEntry(0,0), this->GetEntry(1,0), 1);
+	}
+	constexpr EntryType& x(){ return this->Entry(0,0); }
+	constexpr EntryType& y(){ return this->Entry(1,0); }
+	constexpr EntryType x() const{ return this->GetEntry(0,0); }
+	constexpr EntryType y() const{ return this->GetEntry(1,0); }
+};
+
+typedef BasicMatrix3<float> Matrix3;
+typedef BasicMatrix3<double> Matrix3d;
+typedef BasicMatrix3<Fixed16> Matrix3x;
+typedef BasicMatrix2<float> Matrix2;
+typedef BasicMatrix2<double> Matrix2d;
+typedef BasicMatrix2<Fixed16> Matrix2x;
+typedef BasicVector3<float> Vector3;
+typedef BasicVector3<double> Vector3d;
+typedef BasicVector3<Fixed16> Vector3x;
+typedef BasicVector2<float> Vector2;
+typedef BasicVector2<double> Vector2d;
+typedef BasicVector2<Fixed16> Vector2x;
+
+static_assert(std::is_trivially_copyable<Matrix3>::value && sizeof(Matrix3) == 9*sizeof(float), "Matrix3 should be a plain array of entries");
+static_assert(std::is_trivially_copyable<Vector3>::value && sizeof(Vector3) == 3*sizeof(float), "Vector3 should be a plain array of entries");
+static_assert(std::is_trivially_copyable<Vector2>::value && sizeof(Vector2) == 2*sizeof(float), "Vector2 should be a plain array of entries");
+
+//Assigning an expression to one of its own operands (M = A + M, M = A*B + M,
+//M *= M) must read M before it is overwritten
+constexpr bool MatrixSelfAssignmentWorks(){
+	const float a[2][2] = {{1,2},{3,4}}, m[2][2] = {{10,20},{30,40}};
+	SquareMatrix<2> A(a), M(m), N(m), P(m);
+	M = A + M;
+	N = A*A + N;
+	P *= P;
+	return M(0,0) == 11 && M(0,1) == 22 && M(1,0) == 33 && M(1,1) == 44
+		&& N(0,0) == 17 && N(0,1) == 30 && N(1,0) == 45 && N(1,1) == 62
+		&& P(0,0) == 700 && P(0,1) == 1000 && P(1,0) == 1500 && P(1,1) == 2200;
+}
+static_assert(MatrixSelfAssignmentWorks(), "M = A + M should add A to the old M");
+
+
+//A 2d affine transformation, stored as the top two rows of the equivalent
+//homogeneous Matrix3:
+//   [ m00 m01 m02 ]
+//   [ m10 m11 m12 ]
+//   [  0   0   1  ]
+//Composition takes 12 multiplies (vs. 27 for a Matrix3 product) and the
+//type is trivially copyable, so it is cheap to keep on a stack.
+//Affine2 (float) is the usual type; Affine2d is for long chains of
+//compositions where float error accumulates, and Affine2x (16.16 fixed
+//point) gives an all-integer path to pixel coordinates.
+template<class T>
+class BasicAffine2{
+public:
+	typedef T EntryType;
+	EntryType m00, m01, m02;
+	EntryType m10, m11, m12;
+
+	constexpr BasicAffine2(): m00(1), m01(0), m02(0), m10(0), m11(1), m12(0){ }
+	constexpr BasicAffine2(EntryType a00, EntryType a01, EntryType a02,
+	        EntryType a10, EntryType a11, EntryType a12):
+		m00(a00), m01(a01), m02(a02), m10(a10), m11(a11), m12(a12){ }
+	//Convert from another entry type
+	template<class U>
+	explicit constexpr BasicAffine2(const BasicAffine2<U>& o):
+		m00(T(o.m00)), m01(T(o.m01)), m02(T(o.m02)), m10(T(o.m10)), m11(T(o.m11)), m12(T(o.m12)){ }
+	//The bottom row of M is assumed to be (0 0 1)
+	explicit constexpr BasicAffine2(const GeneralMatrix<3,3,T>& M):
+		m00(M.GetEntry(0,0)), m01(M.GetEntry(0,1)), m02(M.GetEntry(0,2)),
+		m10(M.GetEntry(1,0)), m11(M.GetEntry(1,1)), m12(M.GetEntry(1,2)){ }
+	
+	constexpr BasicMatrix3<T> ToMatrix3() const{
+		return BasicMatrix3<T>( m00, m01, m02,
+		                m10, m11, m12,
+		                0, 0, 1);
+	}
+	
+	constexpr void identity(){
+		m00 = m11 = 1;
+		m01 = m02 = m10 = m12 = 0;
+	}
+	
+	//Same conventions as the corresponding Matrix3 constructions
+	static BasicAffine2 Rotation(double radians){
+		EntryType c = T(cos(radians)), s = T(sin(radians));
+		return BasicAffine2( c, s, 0,
+		               -s, c, 0);
+	}
+	static constexpr BasicAffine2 Scale(EntryType sx, EntryType sy){
+		return BasicAffine2(sx, 0, 0,
+		               0, sy, 0);
 	}
-	Vector2& operator=(const GeneralMatrix<2,1>& other){
-		*((GeneralMatrix<2,1>*)this) = other;
+	static constexpr BasicAffine2 Translation(EntryType tx, EntryType ty){
+		return BasicAffine2(1, 0, tx,
+		               0, 1, ty);
+	}
+	
+	//Composition (this transform is applied after other)
+	constexpr BasicAffine2 operator *(const BasicAffine2& other) const{
+		return BasicAffine2( m00*other.m00 + m01*other.m10, m00*other.m01 + m01*other.m11, m00*other.m02 + m01*other.m12 + m02,
+		                m10*other.m00 + m11*other.m10, m10*other.m01 + m11*other.m11, m10*other.m02 + m11*other.m12 + m12);
+	}
+	constexpr BasicAffine2& operator *=(const BasicAffine2& other){
+		*this = *this * other;
 		return *this;
 	}
-	Vector2& operator=(const Vector2& other){
-		x = other.x;
-		y = other.y;
+	
+	//In-place right multiplication by the elementary transforms
+	//(equivalent to *= Rotation(...) etc. but without the multiplies by 0 and 1)
+	constexpr BasicAffine2& rotate(EntryType c, EntryType s){ //c and s are the cosine and sine of the angle
+		EntryType a = m00, b = m01;
+		m00 = a*c - b*s;
+		m01 = a*s + b*c;
+		a = m10; b = m11;
+		m10 = a*c - b*s;
+		m11 = a*s + b*c;
 		return *this;
 	}
-	Vector3 ToHomogeneousVector3() const{
-		return Vector3(this->GetEntry(0,0), this->GetEntry(0,1), 1);
+	BasicAffine2& rotate(double radians){
+		return rotate(T(cos(radians)), T(sin(radians)));
+	}
+	constexpr BasicAffine2& scale(EntryType sx, EntryType sy){
+		m00 *= sx; m10 *= sx;
+		m01 *= sy; m11 *= sy;
+		return *this;
+	}
+	constexpr BasicAffine2& translate(EntryType tx, EntryType ty){
+		m02 = m00*tx + m01*ty + m02;
+		m12 = m10*tx + m11*ty + m12;
+		return *this;
+	}
+	
+	constexpr EntryType Determinant() const{
+		return m00*m11 - m01*m10;
+	}
+	//The result is undefined if the transform is singular
+	constexpr BasicAffine2 Inverse() const{
+		EntryType inv_det = T(1)/Determinant();
+		EntryType i00 =  m11*inv_det, i01 = -m01*inv_det;
+		EntryType i10 = -m10*inv_det, i11 =  m00*inv_det;
+		return BasicAffine2( i00, i01, -(i00*m02 + i01*m12),
+		                i10, i11, -(i10*m02 + i11*m12));
+	}
+	
+	//Transform the point (x,y)
+	constexpr void Apply(EntryType x, EntryType y, EntryType& out_x, EntryType& out_y) const{
+		out_x = m00*x + m01*y + m02;
+		out_y = m10*x + m11*y + m12;
+	}
+	
+	//Batch versions of Apply for n points stored as separate x and y arrays.
+	//The Rounded version rounds to the nearest integer (halfway cases away
+	//from zero, like roundf) and saturates to the range of int16_t.
+	//For float transforms both use SSE2 or AVX2 when available (see below).
+	void TransformPoints(const float* x, const float* y, float* out_x, float* out_y, int n) const;
+	void TransformPointsRounded(const float* x, const float* y, int16_t* out_x, int16_t* out_y, int n) const;
+	
+	void print() const{
+		typedef ScalarTraits<T> S;
+		printf("%.2f %.2f %.2f\n%.2f %.2f %.2f\n\n",S::ToDouble(m00),S::ToDouble(m01),S::ToDouble(m02),S::ToDouble(m10),S::ToDouble(m11),S::ToDouble(m12));
 	}
-	EntryType& x;
-	EntryType& y;
 };
 
+typedef BasicAffine2<float> Affine2;
+typedef BasicAffine2<double> Affine2d;
+typedef BasicAffine2<Fixed16> Affine2x;
+
+static_assert(std::is_trivially_copyable<Affine2>::value && sizeof(Affine2) == 6*sizeof(float), "Affine2 should be six packed entries");
+static_assert(std::is_trivially_copyable<Affine2x>::value && sizeof(Affine2x) == 6*sizeof(int32_t), "Affine2x should be six packed entries");
+
+
+//Batch point transformation kernels
+//Each kernel handles points [start, n) and returns; the SIMD kernels stop
+//at the last full vector and finish with the scalar one.
+
+//Saturating; NaN gives 32767, as in the SIMD kernels (where the clamp to
+//32767 comes first and _mm_min_ps returns its second operand for NaN)
+static inline int16_t RoundToInt16(float v){
+	if (!(v < 32767.0f))
+		return 32767;
+	if (v < -32768.0f)
+		return -32768;
+	return (int16_t)roundf(v);
+}
+static inline int16_t RoundToInt16(double v){
+	if (!(v < 32767.0))
+		return 32767;
+	if (v < -32768.0)
+		return -32768;
+	return (int16_t)round(v);
+}
+static inline int16_t RoundToInt16(Fixed16 v){ //Integer only (no conversion to float)
+	int32_t r = v.RoundToInt();
+	return r > 32767? 32767: (int16_t)r; //(32767.5 and up round to 32768)
+}
+static inline void TransformPointsScalar(const Affine2& T, const float* x, const float* y, float* out_x, float* out_y, int start, int n){
+	for (int i = start; i < n; i++)
+		T.Apply(x[i], y[i], out_x[i], out_y[i]);
+}
+static inline void TransformPointsRoundedScalar(const Affine2& T, const float* x, const float* y, int16_t* out_x, int16_t* out_y, int start, int n){
+	float tx, ty;
+	for (int i = start; i < n; i++){
+		T.Apply(x[i], y[i], tx, ty);
+		out_x[i] = RoundToInt16(tx);
+		out_y[i] = RoundToInt16(ty);
+	}
+}
+
+#if MATRIX_SIMD
+//Round-half-away-from-zero and saturate 4 floats to int32 lanes in [-32768,32767]
+static inline __m128i RoundToInt16Lanes_SSE2(__m128 v){
+	v = _mm_max_ps(_mm_min_ps(v, _mm_set1_ps(32767.0f)), _mm_set1_ps(-32768.0f));
+	__m128i t = _mm_cvttps_epi32(v);
+	__m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(t)); //Exact
+	//The comparison masks are -1 where true
+	t = _mm_sub_epi32(t, _mm_castps_si128(_mm_cmpge_ps(frac, _mm_set1_ps(0.5f))));
+	t = _mm_add_epi32(t, _mm_castps_si128(_mm_cmple_ps(frac, _mm_set1_ps(-0.5f))));
+	return t;
+}
+static inline void TransformPoints_SSE2(const Affine2& T, const float* x, const float* y, float* out_x, float* out_y, int n){
+	const __m128 m00 = _mm_set1_ps(T.m00), m01 = _mm_set1_ps(T.m01), m02 = _mm_set1_ps(T.m02);
+	const __m128 m10 = _mm_set1_ps(T.m10), m11 = _mm_set1_ps(T.m11), m12 = _mm_set1_ps(T.m12);
+	int i = 0;
+	for (; i + 4 <= n; i += 4){
+		__m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i);
+		_mm_storeu_ps(out_x + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, vx), _mm_mul_ps(m01, vy)), m02));
+		_mm_storeu_ps(out_y + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, vx), _mm_mul_ps(m11, vy)), m12));
+	}
+	TransformPointsScalar(T, x, y, out_x, out_y, i, n);
+}
+static inline void TransformPointsRounded_SSE2(const Affine2& T, const float* x, const float* y, int16_t* out_x, int16_t* out_y, int n){
+	const __m128 m00 = _mm_set1_ps(T.m00), m01 = _mm_set1_ps(T.m01), m02 = _mm_set1_ps(T.m02);
+	const __m128 m10 = _mm_set1_ps(T.m10), m11 = _mm_set1_ps(T.m11), m12 = _mm_set1_ps(T.m12);
+	int i = 0;
+	for (; i + 8 <= n; i += 8){
+		__m128 vx0 = _mm_loadu_ps(x + i), vy0 = _mm_loadu_ps(y + i);
+		__m128 vx1 = _mm_loadu_ps(x + i + 4), vy1 = _mm_loadu_ps(y + i + 4);
+		__m128i rx0 = RoundToInt16Lanes_SSE2(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, vx0), _mm_mul_ps(m01, vy0)), m02));
+		__m128i rx1 = RoundToInt16Lanes_SSE2(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, vx1), _mm_mul_ps(m01, vy1)), m02));
+		__m128i ry0 = RoundToInt16Lanes_SSE2(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, vx0), _mm_mul_ps(m11, vy0)), m12));
+		__m128i ry1 = RoundToInt16Lanes_SSE2(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, vx1), _mm_mul_ps(m11, vy1)), m12));
+		_mm_storeu_si128((__m128i*)(out_x + i), _mm_packs_epi32(rx0, rx1));
+		_mm_storeu_si128((__m128i*)(out_y + i), _mm_packs_epi32(ry0, ry1));
+	}
+	TransformPointsRoundedScalar(T, x, y, out_x, out_y, i, n);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i RoundToInt16Lanes_AVX2(__m256 v){
+	v = _mm256_max_ps(_mm256_min_ps(v, _mm256_set1_ps(32767.0f)), _mm256_set1_ps(-32768.0f));
+	__m256i t = _mm256_cvttps_epi32(v);
+	__m256 frac = _mm256_sub_ps(v, _mm256_cvtepi32_ps(t));
+	t = _mm256_sub_epi32(t, _mm256_castps_si256(_mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ)));
+	t = _mm256_add_epi32(t, _mm256_castps_si256(_mm256_cmp_ps(frac, _mm256_set1_ps(-0.5f), _CMP_LE_OQ)));
+	return t;
+}
+__attribute__((target("avx2")))
+static inline void TransformPoints_AVX2(const Affine2& T, const float* x, const float* y, float* out_x, float* out_y, int n){
+	const __m256 m00 = _mm256_set1_ps(T.m00), m01 = _mm256_set1_ps(T.m01), m02 = _mm256_set1_ps(T.m02);
+	const __m256 m10 = _mm256_set1_ps(T.m10), m11 = _mm256_set1_ps(T.m11), m12 = _mm256_set1_ps(T.m12);
+	int i = 0;
+	for (; i + 8 <= n; i += 8){
+		__m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i);
+		_mm256_storeu_ps(out_x + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m00, vx), _mm256_mul_ps(m01, vy)), m02));
+		_mm256_storeu_ps(out_y + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m10, vx), _mm256_mul_ps(m11, vy)), m12));
+	}
+	TransformPointsScalar(T, x, y, out_x, out_y, i, n);
+}
+__attribute__((target("avx2")))
+static inline void TransformPointsRounded_AVX2(const Affine2& T, const float* x, const float* y, int16_t* out_x, int16_t* out_y, int n){
+	const __m256 m00 = _mm256_set1_ps(T.m00), m01 = _mm256_set1_ps(T.m01), m02 = _mm256_set1_ps(T.m02);
+	const __m256 m10 = _mm256_set1_ps(T.m10), m11 = _mm256_set1_ps(T.m11), m12 = _mm256_set1_ps(T.m12);
+	int i = 0;
+	for (; i + 8 <= n; i += 8){
+		__m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i);
+		__m256i rx = RoundToInt16Lanes_AVX2(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m00, vx), _mm256_mul_ps(m01, vy)), m02));
+		__m256i ry = RoundToInt16Lanes_AVX2(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m10, vx), _mm256_mul_ps(m11, vy)), m12));
+		//packs works within 128-bit lanes, so pack the two halves explicitly
+		_mm_storeu_si128((__m128i*)(out_x + i), _mm_packs_epi32(_mm256_castsi256_si128(rx), _mm256_extracti128_si256(rx, 1)));
+		_mm_storeu_si128((__m128i*)(out_y + i), _mm_packs_epi32(_mm256_castsi256_si128(ry), _mm256_extracti128_si256(ry, 1)));
+	}
+	TransformPointsRoundedScalar(T, x, y, out_x, out_y, i, n);
+}
+
+static inline bool CPUHasAVX2(){
+	static const bool has_avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+	return has_avx2;
+}
+#endif
+
+//Generic versions (double and fixed point)
+template<class T>
+inline void BasicAffine2<T>::TransformPoints(const float* x, const float* y, float* out_x, float* out_y, int n) const{
+	T tx, ty;
+	for (int i = 0; i < n; i++){
+		Apply(T(x[i]), T(y[i]), tx, ty);
+		out_x[i] = float(tx);
+		out_y[i] = float(ty);
+	}
+}
+template<class T>
+inline void BasicAffine2<T>::TransformPointsRounded(const float* x, const float* y, int16_t* out_x, int16_t* out_y, int n) const{
+	T tx, ty;
+	for (int i = 0; i < n; i++){
+		Apply(T(x[i]), T(y[i]), tx, ty);
+		out_x[i] = RoundToInt16(tx);
+		out_y[i] = RoundToInt16(ty);
+	}
+}
+
+//Points which are already in fixed point: integer arithmetic only, from
+//the inputs to the rounded int16 outputs (the member version above has to
+//convert each float input first)
+inline void TransformPointsRounded(const Affine2x& T, const Fixed16* x, const Fixed16* y, int16_t* out_x, int16_t* out_y, int n){
+	Fixed16 tx, ty;
+	for (int i = 0; i < n; i++){
+		T.Apply(x[i], y[i], tx, ty);
+		out_x[i] = RoundToInt16(tx);
+		out_y[i] = RoundToInt16(ty);
+	}
+}
+
+template<>
+inline void Affine2::TransformPoints(const float* x, const float* y, float* out_x, float* out_y, int n) const{
+#if MATRIX_SIMD
+	if (CPUHasAVX2())
+		TransformPoints_AVX2(*this, x, y, out_x, out_y, n);
+	else
+		TransformPoints_SSE2(*this, x, y, out_x, out_y, n);
+#else
+	TransformPointsScalar(*this, x, y, out_x, out_y, 0, n);
+#endif
+}
+template<>
+inline void Affine2::TransformPointsRounded(const float* x, const float* y, int16_t* out_x, int16_t* out_y, int n) const{
+#if MATRIX_SIMD
+	if (CPUHasAVX2())
+		TransformPointsRounded_AVX2(*this, x, y, out_x, out_y, n);
+	else
+		TransformPointsRounded_SSE2(*this, x, y, out_x, out_y, n);
+#else
+	TransformPointsRoundedScalar(*this, x, y, out_x, out_y, 0, n);
+#endif
+}
 
 
 #endif
@@ -0,0 +1,116 @@
+/* parallel.h
+
+   A minimal parallel for loop, for work which is split into independent
+   pieces, run by a persistent pool of worker threads.
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+//Worker threads which run ParallelFor loops for one calling thread. The
+//workers are started the first time a loop needs them and are kept (asleep)
+//until the calling thread exits, so each loop only costs a wake-up.
+class ParallelPool{
+public:
+	ParallelPool(): loop(NULL), n(0), job(0), active(0), busy(0), quit(false){ }
+	~ParallelPool(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (unsigned int i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+	//Call f(0) ... f(n - 1) on the calling thread and threads - 1 workers
+	void Run(int n, int threads, const std::function<void(int)>& f){
+		//(A new worker starts out having seen every job before this one)
+		while ((int)workers.size() < threads - 1)
+			workers.push_back(std::thread(&ParallelPool::WorkerMain, this, (int)workers.size(), job));
+		next = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			loop = &f;
+			this->n = n;
+			active = busy = threads - 1;
+			job++;
+		}
+		wake.notify_all();
+		Work();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (busy > 0)
+				done.wait(lock);
+			loop = NULL;
+		}
+	}
+
+private:
+	//Each thread claims the next index when it finishes one, so pieces of
+	//uneven size still balance
+	void Work(){
+		int i;
+		while ((i = next++) < n)
+			(*loop)(i);
+	}
+	void WorkerMain(int index, unsigned long seen){
+		while (1){
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!quit && job == seen)
+					wake.wait(lock);
+				if (quit)
+					return;
+				seen = job;
+				//Only the first 'active' workers take part in this job
+				if (index >= active)
+					continue;
+			}
+			Work();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy--;
+			}
+			done.notify_one();
+		}
+	}
+
+	const std::function<void(int)>* loop;
+	int n;
+	std::atomic<int> next;
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	unsigned long job; //Incremented for each Run
+	int active; //Workers taking part in the current job
+	int busy; //Workers still running the current job
+	bool quit;
+};
+
+//Call f(0) ... f(n - 1), shared between the given number of threads
+//(including the calling one; 0 uses one per hardware thread, and no more
+//than n are used). Each calling thread has its own pool, so loops started
+//from different threads don't wait for each other.
+inline void ParallelFor(int n, int threads, const std::function<void(int)>& f){
+	if (threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = std::min(threads, n);
+	if (threads <= 1){
+		for (int i = 0; i < n; i++)
+			f(i);
+		return;
+	}
+	static thread_local ParallelPool pool;
+	pool.Run(n, threads, f);
+}
+
+#endif
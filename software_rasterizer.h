@@ -0,0 +1,311 @@
+/* software_rasterizer.h
+
+   A CPU framebuffer with polygon, triangle and line drawing, used by
+   TransformedRenderer as an alternative to drawing through SDL_gfx.
+   The framebuffer is uploaded to the screen once per frame.
+*/
+
+#ifndef SOFTWARE_RASTERIZER_H
+#define SOFTWARE_RASTERIZER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "matrix.h"
+
+//Fill rule
+//The polygon fills produce exactly the same pixels as SDL_gfx's
+//filledPolygonRGBA: on each row, the crossings with the edges are
+//computed in 16.16 fixed point with the same (truncating) arithmetic,
+//rounded to pixels and filled in pairs. Exact edge functions would differ
+//from SDL_gfx on the many pixels that are exactly half a pixel from an
+//edge, so they are not used.
+//
+//Convex polygons (almost everything the viewer draws, and every shape
+//registered with TransformedRenderer::add_shape) have exactly two
+//crossings per row, found by walking the left and right chains from the
+//top vertex, so no edge list is built or sorted. Spans are filled 8
+//(AVX2) or 4 (SSE2) pixels at a time. Other polygons use the general
+//scanline fill.
+//
+//Every drawing function can be restricted to a clip rectangle. Nothing
+//outside the clip rectangle is read or written, so several threads can
+//draw into disjoint rectangles of the same framebuffer at once.
+class SoftwareRasterizer{
+public:
+	//A rectangle of pixels (inclusive)
+	struct Clip{
+		int x0, y0, x1, y1;
+	};
+
+	SoftwareRasterizer(): width(0), height(0), pitch(0){ }
+
+	//Resize the framebuffer (the contents are undefined afterwards)
+	void Resize(int w, int h){
+		if (w == width && h == height)
+			return;
+		width = w;
+		height = h;
+		pitch = w;
+		pixels.assign((size_t)pitch*(h > 0? h: 0), 0);
+	}
+	int Width() const{ return width; }
+	int Height() const{ return height; }
+	//Row y of the framebuffer (ARGB8888)
+	const uint32_t* Row(int y) const{ return &pixels[(size_t)y*pitch]; }
+	//The whole framebuffer
+	Clip Bounds() const{
+		Clip c = {0, 0, width - 1, height - 1};
+		return c;
+	}
+
+	static uint32_t Pack(uint8_t r, uint8_t g, uint8_t b, uint8_t a){
+		return ((uint32_t)a << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+	}
+
+	void Clear(uint32_t colour){
+		std::fill(pixels.begin(), pixels.end(), colour);
+	}
+
+	void FillTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1, int16_t x2, int16_t y2, uint32_t colour){
+		int16_t x[] = {x0, x1, x2};
+		int16_t y[] = {y0, y1, y2};
+		FillConvex(x, y, 3, colour, Bounds());
+	}
+
+	//Fill an arbitrary polygon (with the even-odd rule, like SDL_gfx)
+	void FillPolygon(const int16_t* x, const int16_t* y, int n, uint32_t colour){
+		FillPolygon(x, y, n, colour, Bounds());
+	}
+	void FillPolygon(const int16_t* x, const int16_t* y, int n, uint32_t colour, const Clip& clip){
+		if (IsConvex(x, y, n))
+			FillConvex(x, y, n, colour, clip);
+		else
+			FillScanline(x, y, n, colour, clip);
+	}
+
+	//Fill a polygon which is known to be convex (see IsConvex)
+	void FillConvex(const int16_t* x, const int16_t* y, int n, uint32_t colour){
+		FillConvex(x, y, n, colour, Bounds());
+	}
+	void FillConvex(const int16_t* x, const int16_t* y, int n, uint32_t colour, const Clip& clip){
+		if (n < 3 || clip.x0 > clip.x1 || clip.y0 > clip.y1)
+			return;
+		int top = 0, min_y = y[0], max_y = y[0];
+		for (int i = 1; i < n; i++){
+			if (y[i] < min_y){
+				min_y = y[i];
+				top = i;
+			}
+			max_y = std::max(max_y, (int)y[i]);
+		}
+		//(SDL_gfx draws nothing for a polygon with no height)
+		if (min_y == max_y)
+			return;
+		//Each chain is the edge from chain[0] to chain[1], walking forwards
+		//(left) or backwards (right) through the vertices from the top
+		int left[2] = {top, (top + 1) % n};
+		int right[2] = {top, (top + n - 1) % n};
+		int y_end = std::min(max_y, clip.y1);
+		for (int row = std::max(min_y, clip.y0); row <= y_end; row++){
+			Advance(left, y, n, row, max_y, 1);
+			Advance(right, y, n, row, max_y, n - 1);
+			int64_t a = Crossing(x, y, left[0], left[1], row);
+			int64_t b = Crossing(x, y, right[0], right[1], row);
+			if (a > b)
+				std::swap(a, b);
+			FillCrossings(row, a, b, colour, clip);
+		}
+	}
+
+	//Draw a line with Bresenham's algorithm (both endpoints are drawn)
+	void DrawLine(int x0, int y0, int x1, int y1, uint32_t colour){
+		DrawLine(x0, y0, x1, y1, colour, Bounds());
+	}
+	void DrawLine(int x0, int y0, int x1, int y1, uint32_t colour, const Clip& clip){
+		int dx = abs(x1 - x0), sx = x0 < x1? 1: -1;
+		int dy = -abs(y1 - y0), sy = y0 < y1? 1: -1;
+		int err = dx + dy;
+		while (1){
+			if (x0 >= clip.x0 && x0 <= clip.x1 && y0 >= clip.y0 && y0 <= clip.y1)
+				PutPixel(&pixels[(size_t)y0*pitch + x0], colour);
+			if (x0 == x1 && y0 == y1)
+				break;
+			int e2 = 2*err;
+			if (e2 >= dy){
+				err += dy;
+				x0 += sx;
+			}
+			if (e2 <= dx){
+				err += dx;
+				y0 += sy;
+			}
+		}
+	}
+
+	//Draw the closed outline of a polygon
+	void DrawPolygon(const int16_t* x, const int16_t* y, int n, uint32_t colour){
+		DrawPolygon(x, y, n, colour, Bounds());
+	}
+	void DrawPolygon(const int16_t* x, const int16_t* y, int n, uint32_t colour, const Clip& clip){
+		if (n < 3)
+			return;
+		for (int i = 0; i < n; i++){
+			int j = (i + 1) % n;
+			DrawLine(x[i], y[i], x[j], y[j], colour, clip);
+		}
+	}
+
+	//True if the polygon is convex (in the sense that matters for
+	//FillConvex: consistently turning and monotone in y). Collinear and
+	//repeated vertices are allowed.
+	static bool IsConvex(const int16_t* x, const int16_t* y, int n){
+		int turn = 0, dir_changes = 0, last_dir = 0, first_dir = 0;
+		for (int i = 0; i < n; i++){
+			int j = (i + 1) % n, k = (i + 2) % n;
+			int64_t cross = ((int64_t)x[j] - x[i])*((int64_t)y[k] - y[j]) - ((int64_t)y[j] - y[i])*((int64_t)x[k] - x[j]);
+			int s = (cross > 0) - (cross < 0);
+			if (s != 0){
+				if (turn != 0 && s != turn)
+					return false;
+				turn = s;
+			}
+			int dir = (y[j] > y[i]) - (y[j] < y[i]);
+			if (dir != 0){
+				if (last_dir != 0 && dir != last_dir)
+					dir_changes++;
+				else if (last_dir == 0)
+					first_dir = dir;
+				last_dir = dir;
+			}
+		}
+		if (last_dir != 0 && last_dir != first_dir)
+			dir_changes++;
+		return dir_changes <= 2;
+	}
+
+private:
+	static inline uint32_t BlendPixel(uint32_t dst, uint32_t src){
+		uint32_t a = src >> 24;
+		if (a == 255)
+			return src;
+		uint32_t inv = 255 - a;
+		uint32_t r = (((src >> 16) & 0xFF)*a + ((dst >> 16) & 0xFF)*inv)/255;
+		uint32_t g = (((src >> 8) & 0xFF)*a + ((dst >> 8) & 0xFF)*inv)/255;
+		uint32_t b = ((src & 0xFF)*a + (dst & 0xFF)*inv)/255;
+		return (dst & 0xFF000000u) | (r << 16) | (g << 8) | b;
+	}
+	static inline void PutPixel(uint32_t* p, uint32_t colour){
+		*p = BlendPixel(*p, colour);
+	}
+
+	//Move a chain down to the edge which SDL_gfx uses on the given row:
+	//the edge whose y range [top, bottom) contains the row, or on the
+	//last row, the edge that ends there
+	static inline void Advance(int* chain, const int16_t* y, int n, int row, int max_y, int step){
+		for (int i = 0; i < n; i++){
+			int y_b = y[chain[1]];
+			if (y_b > row || (y_b == row && row == max_y))
+				break;
+			chain[0] = chain[1];
+			chain[1] = (chain[1] + step) % n;
+		}
+	}
+	//Where the row crosses the edge from vertex i to vertex j, in 16.16
+	//fixed point (SDL_gfx's formula)
+	static inline int64_t Crossing(const int16_t* x, const int16_t* y, int i, int j, int row){
+		int64_t x1 = x[i], y1 = y[i], x2 = x[j], y2 = y[j];
+		if (y1 > y2){
+			std::swap(x1, x2);
+			std::swap(y1, y2);
+		}
+		return ((65536*(row - y1))/(y2 - y1))*(x2 - x1) + 65536*x1;
+	}
+	//Fill between a pair of crossings (like SDL_gfx, which draws the span
+	//as a line, so the ends are swapped if they cross)
+	void FillCrossings(int row, int64_t a, int64_t b, uint32_t colour, const Clip& clip){
+		int64_t xa = (a + 1 + 32768) >> 16;
+		int64_t xb = (b - 1 + 32768) >> 16;
+		if (xa > xb)
+			std::swap(xa, xb);
+		if (xb < clip.x0 || xa > clip.x1)
+			return;
+		FillSpan(&pixels[(size_t)row*pitch], (int)std::max(xa, (int64_t)clip.x0), (int)std::min(xb, (int64_t)clip.x1), colour);
+	}
+	//Fill the pixels p[x_start..x_end]
+	void FillSpan(uint32_t* p, int x_start, int x_end, uint32_t colour){
+		if ((colour >> 24) != 255){
+			for (int x = x_start; x <= x_end; x++)
+				PutPixel(p + x, colour);
+			return;
+		}
+#if MATRIX_SIMD
+		if (CPUHasAVX2())
+			FillSpanAVX2(p, x_start, x_end, colour);
+		else
+			FillSpanSSE2(p, x_start, x_end, colour);
+#else
+		for (int x = x_start; x <= x_end; x++)
+			p[x] = colour;
+#endif
+	}
+#if MATRIX_SIMD
+	//Opaque span fills: whole vectors are stored directly, and the last
+	//(partial) vector is written with a masked store (AVX2) or one pixel
+	//at a time (SSE2), so nothing past x_end is touched
+	static void FillSpanSSE2(uint32_t* p, int x_start, int x_end, uint32_t colour){
+		const __m128i c = _mm_set1_epi32(colour);
+		int x = x_start;
+		for (; x + 4 <= x_end + 1; x += 4)
+			_mm_storeu_si128((__m128i*)(p + x), c);
+		for (; x <= x_end; x++)
+			p[x] = colour;
+	}
+	__attribute__((target("avx2")))
+	static void FillSpanAVX2(uint32_t* p, int x_start, int x_end, uint32_t colour){
+		const __m256i c = _mm256_set1_epi32(colour);
+		int x = x_start;
+		for (; x + 8 <= x_end + 1; x += 8)
+			_mm256_storeu_si256((__m256i*)(p + x), c);
+		if (x <= x_end){
+			__m256i lanes = _mm256_add_epi32(_mm256_set1_epi32(x), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+			__m256i inside = _mm256_cmpgt_epi32(_mm256_set1_epi32(x_end + 1), lanes);
+			_mm256_maskstore_epi32((int*)(p + x), inside, c);
+		}
+	}
+#endif
+
+	//General scanline fill (SDL_gfx's algorithm)
+	void FillScanline(const int16_t* x, const int16_t* y, int n, uint32_t colour, const Clip& clip){
+		if (n < 3)
+			return;
+		int min_y = y[0], max_y = y[0];
+		for (int i = 1; i < n; i++){
+			min_y = std::min(min_y, (int)y[i]);
+			max_y = std::max(max_y, (int)y[i]);
+		}
+		//(Per thread, kept between calls)
+		static thread_local std::vector<int64_t> ints;
+		for (int row = std::max(min_y, clip.y0); row <= std::min(max_y, clip.y1); row++){
+			ints.clear();
+			for (int i = 0; i < n; i++){
+				int j = i? i - 1: n - 1;
+				int y1 = std::min(y[i], y[j]), y2 = std::max(y[i], y[j]);
+				if (y1 == y2)
+					continue;
+				if ((row >= y1 && row < y2) || (row == max_y && row > y1 && row <= y2))
+					ints.push_back(Crossing(x, y, j, i, row));
+			}
+			std::sort(ints.begin(), ints.end());
+			for (size_t i = 0; i + 1 < ints.size(); i += 2)
+				FillCrossings(row, ints[i], ints[i+1], colour, clip);
+		}
+	}
+
+	int width, height, pitch;
+	std::vector<uint32_t> pixels;
+};
+
+#endif
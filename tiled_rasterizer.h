@@ -0,0 +1,223 @@
+/* tiled_rasterizer.h
+
+   Deferred, multithreaded drawing into a SoftwareRasterizer.
+   Drawing commands are recorded, binned into screen tiles and then
+   rasterized in parallel by a pool of worker threads.
+*/
+
+#ifndef TILED_RASTERIZER_H
+#define TILED_RASTERIZER_H
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include "software_rasterizer.h"
+
+//Each tile is drawn by one thread, which runs the commands that overlap
+//the tile in the order they were recorded, clipped to the tile. Since a
+//pixel belongs to exactly one tile, the result is identical to drawing
+//the commands directly in order (so later leaves still cover earlier
+//stems), whatever the number of threads.
+class TiledRasterizer{
+public:
+	static const int TILE_SIZE = 64;
+
+	//threads is the total number of threads drawing (including the one
+	//calling Execute); 0 uses one per hardware thread
+	TiledRasterizer(SoftwareRasterizer& target, int threads = 0): target(target){
+		if (threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		job = 0;
+		busy = 0;
+		quit = false;
+		for (int i = 1; i < threads; i++)
+			workers.push_back(std::thread(&TiledRasterizer::WorkerMain, this));
+	}
+	~TiledRasterizer(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (unsigned int i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+	int Threads() const{
+		return workers.size() + 1;
+	}
+	//Number of commands recorded since the last Execute
+	int Pending() const{
+		return commands.size();
+	}
+
+	void FillPolygon(const int16_t* x, const int16_t* y, int n, uint32_t colour){
+		Record(SoftwareRasterizer::IsConvex(x, y, n)? FILL_CONVEX: FILL_POLYGON, x, y, n, colour);
+	}
+	void FillConvex(const int16_t* x, const int16_t* y, int n, uint32_t colour){
+		Record(FILL_CONVEX, x, y, n, colour);
+	}
+	void DrawPolygon(const int16_t* x, const int16_t* y, int n, uint32_t colour){
+		Record(DRAW_POLYGON, x, y, n, colour);
+	}
+	void DrawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint32_t colour){
+		int16_t x[] = {x0, x1};
+		int16_t y[] = {y0, y1};
+		Record(DRAW_LINE, x, y, 2, colour);
+	}
+
+	//Draw everything recorded so far into the target (using every thread)
+	//and start a new list
+	void Execute(){
+		if (commands.empty())
+			return;
+		Bin();
+		next_tile = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job++;
+			busy = workers.size();
+		}
+		wake.notify_all();
+		DrawTiles();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (busy > 0)
+				done.wait(lock);
+		}
+		commands.clear();
+		vx.clear();
+		vy.clear();
+	}
+
+private:
+	enum CommandType{
+		FILL_CONVEX,
+		FILL_POLYGON,
+		DRAW_POLYGON,
+		DRAW_LINE,
+	};
+	struct Command{
+		int type;
+		uint32_t colour;
+		int first, n; //Vertices vx/vy[first..first+n-1]
+		int x0, y0, x1, y1; //Bounding box
+	};
+
+	void Record(int type, const int16_t* x, const int16_t* y, int n, uint32_t colour){
+		if (n <= 0)
+			return;
+		Command c;
+		c.type = type;
+		c.colour = colour;
+		c.first = vx.size();
+		c.n = n;
+		c.x0 = c.x1 = x[0];
+		c.y0 = c.y1 = y[0];
+		for (int i = 0; i < n; i++){
+			c.x0 = std::min(c.x0, (int)x[i]); c.x1 = std::max(c.x1, (int)x[i]);
+			c.y0 = std::min(c.y0, (int)y[i]); c.y1 = std::max(c.y1, (int)y[i]);
+		}
+		vx.insert(vx.end(), x, x + n);
+		vy.insert(vy.end(), y, y + n);
+		commands.push_back(c);
+	}
+
+	//Add each command to the list of every tile its bounding box overlaps
+	void Bin(){
+		tiles_x = (target.Width() + TILE_SIZE - 1)/TILE_SIZE;
+		tiles_y = (target.Height() + TILE_SIZE - 1)/TILE_SIZE;
+		if ((int)bins.size() < tiles_x*tiles_y)
+			bins.resize(tiles_x*tiles_y);
+		for (int i = 0; i < tiles_x*tiles_y; i++)
+			bins[i].clear();
+		int max_x = target.Width() - 1, max_y = target.Height() - 1;
+		for (unsigned int i = 0; i < commands.size(); i++){
+			const Command& c = commands[i];
+			if (c.x1 < 0 || c.y1 < 0 || c.x0 > max_x || c.y0 > max_y)
+				continue;
+			int tx0 = std::max(c.x0, 0)/TILE_SIZE, tx1 = std::min(c.x1, max_x)/TILE_SIZE;
+			int ty0 = std::max(c.y0, 0)/TILE_SIZE, ty1 = std::min(c.y1, max_y)/TILE_SIZE;
+			for (int ty = ty0; ty <= ty1; ty++)
+				for (int tx = tx0; tx <= tx1; tx++)
+					bins[ty*tiles_x + tx].push_back(i);
+		}
+	}
+
+	//Claim and draw tiles until there are none left
+	void DrawTiles(){
+		int tiles = tiles_x*tiles_y;
+		while (1){
+			int t = next_tile++;
+			if (t >= tiles)
+				break;
+			const std::vector<unsigned int>& bin = bins[t];
+			if (bin.empty())
+				continue;
+			SoftwareRasterizer::Clip clip;
+			clip.x0 = (t % tiles_x)*TILE_SIZE;
+			clip.y0 = (t / tiles_x)*TILE_SIZE;
+			clip.x1 = std::min(clip.x0 + TILE_SIZE, target.Width()) - 1;
+			clip.y1 = std::min(clip.y0 + TILE_SIZE, target.Height()) - 1;
+			for (unsigned int i = 0; i < bin.size(); i++){
+				const Command& c = commands[bin[i]];
+				const int16_t* x = &vx[c.first];
+				const int16_t* y = &vy[c.first];
+				switch(c.type){
+					case FILL_CONVEX:
+						target.FillConvex(x, y, c.n, c.colour, clip);
+						break;
+					case FILL_POLYGON:
+						target.FillPolygon(x, y, c.n, c.colour, clip);
+						break;
+					case DRAW_POLYGON:
+						target.DrawPolygon(x, y, c.n, c.colour, clip);
+						break;
+					case DRAW_LINE:
+						target.DrawLine(x[0], y[0], x[1], y[1], c.colour, clip);
+						break;
+				}
+			}
+		}
+	}
+
+	void WorkerMain(){
+		unsigned long seen = 0;
+		while (1){
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!quit && job == seen)
+					wake.wait(lock);
+				if (quit)
+					return;
+				seen = job;
+			}
+			DrawTiles();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy--;
+			}
+			done.notify_one();
+		}
+	}
+
+	SoftwareRasterizer& target;
+	//The commands recorded since the last Execute, and their vertices
+	std::vector<Command> commands;
+	std::vector<int16_t> vx, vy;
+	std::vector<std::vector<unsigned int> > bins; //Command indices per tile, in order
+	int tiles_x, tiles_y;
+	std::atomic<int> next_tile;
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	unsigned long job; //Incremented for each Execute
+	int busy; //Workers still drawing the current job
+	bool quit;
+};
+
+#endif
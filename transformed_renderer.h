@@ -13,7 +13,18 @@
 #include <SDL2/SDL2_gfxPrimitives.h>
 #include <cmath>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 #include "matrix.h"
+#include "software_rasterizer.h"
+#include "tiled_rasterizer.h"
+
+//SDL_RenderGeometry (used for batching) was added in SDL 2.0.18
+#if SDL_VERSION_ATLEAST(2,0,18)
+#define TR_HAVE_GEOMETRY 1
+#else
+#define TR_HAVE_GEOMETRY 0
+#endif
 
 #ifdef __GNUC__
 #include <alloca.h>
@@ -24,54 +35,258 @@
 #define DEALLOCATE_SINT16_ARRAY(A) delete[] A
 #endif
 
+//n points on the unit circle, stepping clockwise from (1,0) (the same
+//sequence that repeatedly applying the rotation Matrix2 would give),
+//computed at compile time
+template<int n>
+struct CirclePoints{
+	Vector2 points[n];
+	constexpr CirclePoints(): points(){
+		for (int i = 0; i < n; i++)
+			points[i] = Vector2(ConstCos(2*M_PI*i/n), -ConstSin(2*M_PI*i/n));
+	}
+};
+
+//Batching
+//When batching is enabled, the filled shapes that are known to be convex
+//(rectangles, circles and shapes registered with add_shape, which are
+//triangulated once when registered) and all outlines (as one pixel wide
+//quads) are transformed into a vertex buffer instead of being drawn
+//immediately. The buffer is submitted with a single SDL_RenderGeometry
+//call when flush() is called, when it fills up, or before anything is
+//drawn that can't be batched (so the drawing order is preserved).
+//Without SDL_RenderGeometry (SDL < 2.0.18) everything is drawn immediately.
+//
+//Backends
+//BACKEND_SDL draws through SDL_gfx (or SDL_RenderGeometry when batching).
+//BACKEND_SOFTWARE draws everything into a SoftwareRasterizer framebuffer
+//(see software_rasterizer.h for the fill rule, which matches SDL_gfx),
+//which is uploaded to a streaming texture and copied to the renderer by
+//flush(). BACKEND_TILED records the same drawing into a TiledRasterizer,
+//which bins it into screen tiles and draws the tiles on every core when
+//flush() is called (the image is the same). With either software backend
+//each frame must start with clear(), and batching has no effect.
+//
+//Clipping
+//Every primitive is tested against the render target after it is
+//transformed. Primitives whose bounding box is entirely off-screen are
+//rejected without being drawn. Primitives that reach beyond a guard band
+//(GUARD_MARGIN pixels around the target) are clipped to it with the
+//Sutherland-Hodgman algorithm (lines with Liang-Barsky) before they are
+//rounded to the 16 bit coordinates SDL_gfx takes, so far away vertices
+//can't wrap around. Anything within the guard band is drawn unchanged.
+//The counts are kept in get_clip_stats().
 class TransformedRenderer{
 public:
 	static const int CIRCLE_POINTS = 16;
+	static constexpr CirclePoints<CIRCLE_POINTS> unit_circle = CirclePoints<CIRCLE_POINTS>();
+	static const int BATCH_FLUSH_VERTICES = 1 << 18;
+	
+	static const int GUARD_MARGIN = 256;
+	
+	enum Backend{
+		BACKEND_SDL,
+		BACKEND_SOFTWARE,
+		BACKEND_TILED,
+	};
+	
 	TransformedRenderer(SDL_Renderer* renderer){
 		this->renderer = renderer;
+		batching = false;
+		backend = BACKEND_SDL;
+		software_dirty = false;
+		texture = NULL;
+		tiled = NULL;
+		update_viewport();
+		reset_clip_stats();
+		circle_shape = add_circle_shape();
+	}
+	~TransformedRenderer(){
+		flush();
+		if (texture)
+			SDL_DestroyTexture(texture);
+		delete tiled;
 	}
     void set_renderer(SDL_Renderer* r){
+        flush();
+        if (r != renderer && texture){
+            //The texture belongs to the old renderer
+            SDL_DestroyTexture(texture);
+            texture = NULL;
+        }
         this->renderer = r;
+        update_viewport();
     }    
+	
+	void set_backend(Backend b){
+		flush();
+		backend = b;
+		//(The worker threads are only started if they are needed)
+		if (backend == BACKEND_TILED && !tiled)
+			tiled = new TiledRasterizer(raster);
+	}
+	Backend get_backend(){
+		return backend;
+	}
+	
+	//Start a frame by clearing the whole render target
+	void clear(Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+		flush();
+		update_viewport();
+		if (software()){
+			raster.Resize(view_w, view_h);
+			raster.Clear(SoftwareRasterizer::Pack(r, g, b, a));
+			software_dirty = true;
+		}else{
+			SDL_SetRenderDrawColor(renderer, r, g, b, a);
+			SDL_RenderClear(renderer);
+		}
+	}
+	
+	struct ClipStats{
+		unsigned long primitives; //Primitives submitted
+		unsigned long rejected; //Entirely off-screen (not drawn)
+		unsigned long clipped; //Clipped to the guard band before drawing
+	};
+	ClipStats get_clip_stats(){
+		return clip_stats;
+	}
+	void reset_clip_stats(){
+		clip_stats.primitives = clip_stats.rejected = clip_stats.clipped = 0;
+	}
+	
+	void set_batching(bool enabled){
+		if (!enabled)
+			flush();
+		batching = enabled && TR_HAVE_GEOMETRY;
+	}
+	bool is_batching(){
+		return batching;
+	}
+	//True if the frame drawn so far survives a present (the software
+	//backends keep their own framebuffer, so more can be drawn over it and
+	//flushed again; SDL's back buffer is undefined after a present)
+	bool keeps_frame(){
+		return software();
+	}
+	//Draw everything in the batch (or, with the software backend, copy the
+	//framebuffer to the renderer)
+	void flush(){
+		if (software())
+			flushSoftware();
+		else
+			flushBatch();
+	}
+	
+	//Register a fixed polygon (in model coordinates) which will be drawn
+	//many times. The polygon must be convex (more precisely, every vertex
+	//must be visible from the first one); it is triangulated as a fan.
+	//Returns the id to pass to fillShape/drawShape.
+	int add_shape(const float* vx, const float* vy, int n){
+		Shape shape;
+		shape.vx.assign(vx, vx + n);
+		shape.vy.assign(vy, vy + n);
+		for (int i = 1; i + 1 < n; i++){
+			shape.triangles.push_back(0);
+			shape.triangles.push_back(i);
+			shape.triangles.push_back(i+1);
+		}
+		shapes.push_back(shape);
+		return shapes.size() - 1;
+	}
+	void fillShape(int id, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+		Shape& shape = shapes[id];
+		if (batch_active())
+			batchTriangles(&shape.vx[0], &shape.vy[0], shape.vx.size(), &shape.triangles[0], shape.triangles.size(), r, g, b, a);
+		else
+			fillPolygon(&shape.vx[0], &shape.vy[0], shape.vx.size(), r, g, b, a);
+	}
+	void drawShape(int id, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+		Shape& shape = shapes[id];
+		drawPolygon(&shape.vx[0], &shape.vy[0], shape.vx.size(), r, g, b, a);
+	}
 	void set_transform(Matrix3& newTransform){
+		this->transform = Affine2(newTransform);
+	}
+	void set_transform(const Affine2& newTransform){
 		this->transform = newTransform;
 	}
+	void set_transform(const Affine2d& newTransform){
+		this->transform = Affine2(newTransform);
+	}
     Matrix3 get_transform(){
-        return transform;
+        return transform.ToMatrix3();
     }
 	
 	void drawLine(float x1, float y1, float x2, float y2, Uint8 width, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
 		Sint16 ix1,iy1,ix2,iy2;
-		TransformVector(x1,y1,ix1,iy1);
-		TransformVector(x2,y2,ix2,iy2);
-
+		if (!clipLine(x1, y1, x2, y2, width, ix1, iy1, ix2, iy2))
+			return;
+		if (software()){
+			softwareLine(ix1, iy1, ix2, iy2, width, SoftwareRasterizer::Pack(r,g,b,a));
+			return;
+		}
+		flushBatch();
 		thickLineRGBA(renderer, ix1, iy1, ix2, iy2, width,r,g,b,a);
 	}
+
+	//A single pixel (the one containing the transformed point)
+	void drawPoint(float x, float y, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+		clip_stats.primitives++;
+		float tx, ty;
+		transform.Apply(x, y, tx, ty);
+		if (view_w > 0 && !(tx > -1 && ty > -1 && tx < view_w && ty < view_h)){
+			clip_stats.rejected++;
+			return;
+		}
+		Sint16 ix = RoundToInt16(tx), iy = RoundToInt16(ty);
+		if (software()){
+			software_dirty = true;
+			if (backend == BACKEND_TILED)
+				tiled->DrawLine(ix, iy, ix, iy, SoftwareRasterizer::Pack(r,g,b,a));
+			else
+				raster.DrawLine(ix, iy, ix, iy, SoftwareRasterizer::Pack(r,g,b,a));
+			return;
+		}
+		if (batch_active()){
+#if TR_HAVE_GEOMETRY
+			SDL_Color c = {r, g, b, a};
+			int base = batch_vertices.size();
+			batchVertex(ix - 0.5f, iy - 0.5f, c);
+			batchVertex(ix + 0.5f, iy - 0.5f, c);
+			batchVertex(ix + 0.5f, iy + 0.5f, c);
+			batchVertex(ix - 0.5f, iy + 0.5f, c);
+			static const int quad[] = {0,1,2, 0,2,3};
+			for (int k = 0; k < 6; k++)
+				batch_indices.push_back(base + quad[k]);
+			if ((int)batch_vertices.size() >= BATCH_FLUSH_VERTICES)
+				flushBatch();
+#endif
+			return;
+		}
+		pixelRGBA(renderer, ix, iy, r, g, b, a);
+	}
 	
 	void drawCircle(float x, float y, float radius, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
-		Matrix2 M( cos(2*M_PI/CIRCLE_POINTS), sin(2*M_PI/CIRCLE_POINTS), -sin(2*M_PI/CIRCLE_POINTS), cos(2*M_PI/CIRCLE_POINTS) );
-		Vector2 V(radius, 0);
-
 		float vx[CIRCLE_POINTS], vy[CIRCLE_POINTS];
 		for (int i = 0; i < CIRCLE_POINTS; i++){
-			vx[i] = x + V.x;
-			vy[i] = y + V.y;
-			V = M*V;
+			vx[i] = x + radius*unit_circle.points[i].x();
+			vy[i] = y + radius*unit_circle.points[i].y();
 		}
 		drawPolygon(vx,vy,CIRCLE_POINTS, r, g, b, a);
 	}
 	
 	void fillCircle(float x, float y, float radius, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
-		Matrix2 M( cos(2*M_PI/CIRCLE_POINTS), sin(2*M_PI/CIRCLE_POINTS), -sin(2*M_PI/CIRCLE_POINTS), cos(2*M_PI/CIRCLE_POINTS) );
-		Vector2 V(radius, 0);
-
 		float vx[CIRCLE_POINTS], vy[CIRCLE_POINTS];
 		for (int i = 0; i < CIRCLE_POINTS; i++){
-			vx[i] = x + V.x;
-			vy[i] = y + V.y;
-			V = M*V;
+			vx[i] = x + radius*unit_circle.points[i].x();
+			vy[i] = y + radius*unit_circle.points[i].y();
 		}
-		fillPolygon(vx,vy,CIRCLE_POINTS, r, g, b, a);
+		if (batch_active()){
+			Shape& circle = shapes[circle_shape];
+			batchTriangles(vx, vy, CIRCLE_POINTS, &circle.triangles[0], circle.triangles.size(), r, g, b, a);
+		}else
+			fillPolygon(vx,vy,CIRCLE_POINTS, r, g, b, a);
 	}
 	
 	void drawRectangle(float x1, float y1, float x2, float y2, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
@@ -83,45 +298,382 @@ public:
 	void fillRectangle(float x1, float y1, float x2, float y2, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
 		float vx[] = {x1,x2,x2,x1};
 		float vy[] = {y1,y1,y2,y2};
-		fillPolygon(vx,vy,4, r,g,b,a );
+		if (batch_active()){
+			static const int quad[] = {0,1,2, 0,2,3};
+			batchTriangles(vx, vy, 4, quad, 6, r, g, b, a);
+		}else
+			fillPolygon(vx,vy,4, r,g,b,a );
 	}
 	
 	void drawPolygon(const float *vx, const float *vy, int n, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+		if (batch_active()){
+			batchOutline(vx, vy, n, r, g, b, a);
+			return;
+		}
 		
 		Sint16* new_vx = ALLOCATE_SINT16_ARRAY(n);
 		Sint16* new_vy = ALLOCATE_SINT16_ARRAY(n);
-		for(int i = 0; i < n; i++)
-			TransformVector(vx[i], vy[i], new_vx[i],new_vy[i]);
+		transform.TransformPointsRounded(vx, vy, new_vx, new_vy, n);
 		
-		polygonRGBA(renderer, new_vx, new_vy,n,r,g,b,a);
+		const Sint16 *px = new_vx, *py = new_vy;
+		int m = n;
+		if (clipPolygon(vx, vy, px, py, m)){
+			if (software())
+				software_dirty = true;
+			if (backend == BACKEND_TILED)
+				tiled->DrawPolygon(px, py, m, SoftwareRasterizer::Pack(r,g,b,a));
+			else if (backend == BACKEND_SOFTWARE)
+				raster.DrawPolygon(px, py, m, SoftwareRasterizer::Pack(r,g,b,a));
+			else
+				polygonRGBA(renderer, px, py,m,r,g,b,a);
+		}
 		
 		DEALLOCATE_SINT16_ARRAY(new_vx);
 		DEALLOCATE_SINT16_ARRAY(new_vy);
 	}
 	
+	//(Arbitrary polygons are always drawn immediately, since they may be concave)
 	void fillPolygon(const float *vx, const float *vy, int n, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+		flushBatch();
 		
 		Sint16* new_vx = ALLOCATE_SINT16_ARRAY(n);
 		Sint16* new_vy = ALLOCATE_SINT16_ARRAY(n);
 		
-		for(int i = 0; i < n; i++)
-			TransformVector(vx[i],vy[i],new_vx[i],new_vy[i]);
+		transform.TransformPointsRounded(vx, vy, new_vx, new_vy, n);
 		
-		filledPolygonRGBA(renderer, new_vx, new_vy,n,r,g,b,a);
+		const Sint16 *px = new_vx, *py = new_vy;
+		int m = n;
+		if (clipPolygon(vx, vy, px, py, m)){
+			if (software())
+				software_dirty = true;
+			if (backend == BACKEND_TILED)
+				tiled->FillPolygon(px, py, m, SoftwareRasterizer::Pack(r,g,b,a));
+			else if (backend == BACKEND_SOFTWARE)
+				raster.FillPolygon(px, py, m, SoftwareRasterizer::Pack(r,g,b,a));
+			else
+				filledPolygonRGBA(renderer, px, py,m,r,g,b,a);
+		}
 		
 		DEALLOCATE_SINT16_ARRAY(new_vx);
 		DEALLOCATE_SINT16_ARRAY(new_vy);
 	}
 
 private:
-	void TransformVector(float in_x, float in_y, Sint16& out_x, Sint16& out_y){
-		Vector3 V = transform*Vector3(in_x,in_y,1);
-		out_x = (Sint16)roundf(V.x);
-		out_y = (Sint16)roundf(V.y);
+	void update_viewport(){
+		view_w = view_h = 0;
+		if (renderer)
+			SDL_GetRendererOutputSize(renderer, &view_w, &view_h);
+	}
+	
+	//Clip a polygon, given in model coordinates (vx/vy) and transformed and
+	//rounded (x/y, which may have saturated). Returns false if nothing
+	//needs to be drawn; otherwise x, y and n are the polygon to draw
+	//(either the one passed in or a clipped copy).
+	bool clipPolygon(const float* vx, const float* vy, const Sint16*& x, const Sint16*& y, int& n){
+		clip_stats.primitives++;
+		if (view_w <= 0 || n <= 0)
+			return true;
+		int min_x = x[0], max_x = x[0], min_y = y[0], max_y = y[0];
+		for (int i = 1; i < n; i++){
+			min_x = std::min(min_x, (int)x[i]); max_x = std::max(max_x, (int)x[i]);
+			min_y = std::min(min_y, (int)y[i]); max_y = std::max(max_y, (int)y[i]);
+		}
+		//(Saturation keeps the order of the coordinates, so this is exact)
+		if (max_x < 0 || max_y < 0 || min_x >= view_w || min_y >= view_h){
+			clip_stats.rejected++;
+			return false;
+		}
+		if (min_x >= -GUARD_MARGIN && min_y >= -GUARD_MARGIN &&
+		    max_x < view_w + GUARD_MARGIN && max_y < view_h + GUARD_MARGIN)
+			return true;
+		
+		//Clip the unrounded polygon to the guard band
+		clip_stats.clipped++;
+		clip_x.clear();
+		clip_y.clear();
+		for (int i = 0; i < n; i++){
+			float tx, ty;
+			transform.Apply(vx[i], vy[i], tx, ty);
+			clip_x.push_back(tx);
+			clip_y.push_back(ty);
+		}
+		double lo_x = -GUARD_MARGIN, hi_x = view_w - 1 + GUARD_MARGIN;
+		double lo_y = -GUARD_MARGIN, hi_y = view_h - 1 + GUARD_MARGIN;
+		clipAgainst(clip_x, clip_y, lo_x, 1);
+		clipAgainst(clip_x, clip_y, hi_x, -1);
+		clipAgainst(clip_y, clip_x, lo_y, 1);
+		clipAgainst(clip_y, clip_x, hi_y, -1);
+		n = clip_x.size();
+		clip_ix.resize(n);
+		clip_iy.resize(n);
+		for (int i = 0; i < n; i++){
+			clip_ix[i] = RoundToInt16(clip_x[i]);
+			clip_iy[i] = RoundToInt16(clip_y[i]);
+		}
+		x = n? &clip_ix[0]: NULL;
+		y = n? &clip_iy[0]: NULL;
+		return n > 0;
+	}
+	//One Sutherland-Hodgman pass: keep the part of the polygon (a, b) where
+	//side*(a - limit) >= 0 (a is the coordinate being clipped)
+	void clipAgainst(std::vector<double>& a, std::vector<double>& b, double limit, int side){
+		int n = a.size();
+		clip_a.clear();
+		clip_b.clear();
+		for (int i = 0; i < n; i++){
+			int j = (i + 1) % n;
+			bool in_i = side*(a[i] - limit) >= 0, in_j = side*(a[j] - limit) >= 0;
+			if (in_i){
+				clip_a.push_back(a[i]);
+				clip_b.push_back(b[i]);
+			}
+			if (in_i != in_j){
+				double t = (limit - a[i])/(a[j] - a[i]);
+				clip_a.push_back(limit);
+				clip_b.push_back(b[i] + t*(b[j] - b[i]));
+			}
+		}
+		a.swap(clip_a);
+		b.swap(clip_b);
+	}
+	
+	//Transform, clip (Liang-Barsky, to the guard band) and round a line.
+	//Returns false if nothing needs to be drawn.
+	bool clipLine(float x1, float y1, float x2, float y2, int width, Sint16& ix1, Sint16& iy1, Sint16& ix2, Sint16& iy2){
+		clip_stats.primitives++;
+		float fx1, fy1, fx2, fy2;
+		transform.Apply(x1, y1, fx1, fy1);
+		transform.Apply(x2, y2, fx2, fy2);
+		double ax = fx1, ay = fy1, dx = fx2 - fx1, dy = fy2 - fy1;
+		if (view_w > 0){
+			double pad = width/2.0 + 1;
+			if (std::max(fx1, fx2) < -pad || std::max(fy1, fy2) < -pad ||
+			    std::min(fx1, fx2) > view_w - 1 + pad || std::min(fy1, fy2) > view_h - 1 + pad){
+				clip_stats.rejected++;
+				return false;
+			}
+			double t0 = 0, t1 = 1;
+			double p[] = {-dx, dx, -dy, dy};
+			double q[] = {ax + GUARD_MARGIN, view_w - 1 + GUARD_MARGIN - ax,
+			              ay + GUARD_MARGIN, view_h - 1 + GUARD_MARGIN - ay};
+			for (int i = 0; i < 4; i++){
+				if (p[i] == 0){
+					if (q[i] < 0){
+						clip_stats.rejected++;
+						return false;
+					}
+				}else{
+					double t = q[i]/p[i];
+					if (p[i] < 0)
+						t0 = std::max(t0, t);
+					else
+						t1 = std::min(t1, t);
+				}
+			}
+			if (t0 > t1){
+				clip_stats.rejected++;
+				return false;
+			}
+			if (t0 > 0 || t1 < 1)
+				clip_stats.clipped++;
+			ix1 = RoundToInt16(ax + t0*dx); iy1 = RoundToInt16(ay + t0*dy);
+			ix2 = RoundToInt16(ax + t1*dx); iy2 = RoundToInt16(ay + t1*dy);
+			return true;
+		}
+		ix1 = RoundToInt16(fx1); iy1 = RoundToInt16(fy1);
+		ix2 = RoundToInt16(fx2); iy2 = RoundToInt16(fy2);
+		return true;
+	}
+	
+	//Reject a batched primitive (transformed, in tx/ty) which is entirely off-screen
+	bool rejectBatched(const float* tx, const float* ty, int n){
+		clip_stats.primitives++;
+		if (view_w <= 0)
+			return false;
+		float min_x = tx[0], max_x = tx[0], min_y = ty[0], max_y = ty[0];
+		for (int i = 1; i < n; i++){
+			min_x = std::min(min_x, tx[i]); max_x = std::max(max_x, tx[i]);
+			min_y = std::min(min_y, ty[i]); max_y = std::max(max_y, ty[i]);
+		}
+		//(Outlines extend a pixel beyond the vertices)
+		if (max_x < -1 || max_y < -1 || min_x > view_w || min_y > view_h){
+			clip_stats.rejected++;
+			return true;
+		}
+		return false;
+	}
+	
+	bool batch_active(){
+		return batching && backend == BACKEND_SDL;
+	}
+	bool software(){
+		return backend == BACKEND_SOFTWARE || backend == BACKEND_TILED;
+	}
+	
+	//Upload the software framebuffer (if anything was drawn since the
+	//last upload) and copy it to the renderer
+	void flushSoftware(){
+		if (!software_dirty)
+			return;
+		software_dirty = false;
+		if (tiled)
+			tiled->Execute();
+		int w = raster.Width(), h = raster.Height();
+		if (w <= 0 || h <= 0)
+			return;
+		if (texture){
+			int tw, th;
+			SDL_QueryTexture(texture, NULL, NULL, &tw, &th);
+			if (tw != w || th != h){
+				SDL_DestroyTexture(texture);
+				texture = NULL;
+			}
+		}
+		if (!texture)
+			texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, w, h);
+		if (!texture)
+			return;
+		void* p;
+		int pitch;
+		if (SDL_LockTexture(texture, NULL, &p, &pitch) != 0)
+			return;
+		for (int y = 0; y < h; y++)
+			memcpy((Uint8*)p + y*pitch, raster.Row(y), w*sizeof(Uint32));
+		SDL_UnlockTexture(texture);
+		SDL_RenderCopy(renderer, texture, NULL, NULL);
+	}
+	//A line in screen coordinates with the software backend (thick lines
+	//are filled as a quad, as SDL_gfx does)
+	void softwareLine(Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Uint8 width, Uint32 colour){
+		software_dirty = true;
+		if (width <= 1 || (x1 == x2 && y1 == y2)){
+			if (backend == BACKEND_TILED)
+				tiled->DrawLine(x1, y1, x2, y2, colour);
+			else
+				raster.DrawLine(x1, y1, x2, y2, colour);
+			return;
+		}
+		float dx = x2 - x1, dy = y2 - y1;
+		float l = sqrtf(dx*dx + dy*dy);
+		float nx = -dy*width/(2*l), ny = dx*width/(2*l);
+		Sint16 qx[] = {(Sint16)roundf(x1 + nx), (Sint16)roundf(x1 - nx), (Sint16)roundf(x2 - nx), (Sint16)roundf(x2 + nx)};
+		Sint16 qy[] = {(Sint16)roundf(y1 + ny), (Sint16)roundf(y1 - ny), (Sint16)roundf(y2 - ny), (Sint16)roundf(y2 + ny)};
+		if (backend == BACKEND_TILED)
+			tiled->FillConvex(qx, qy, 4, colour);
+		else
+			raster.FillConvex(qx, qy, 4, colour);
+	}
+	
+	struct Shape{
+		std::vector<float> vx, vy;
+		std::vector<int> triangles; //Indices into vx/vy, three per triangle
+	};
+	int add_circle_shape(){
+		float vx[CIRCLE_POINTS], vy[CIRCLE_POINTS];
+		for (int i = 0; i < CIRCLE_POINTS; i++){
+			vx[i] = unit_circle.points[i].x();
+			vy[i] = unit_circle.points[i].y();
+		}
+		return add_shape(vx, vy, CIRCLE_POINTS);
+	}
+	
+#if TR_HAVE_GEOMETRY
+	void batchVertex(float x, float y, const SDL_Color& c){
+		SDL_Vertex v;
+		//SDL_gfx draws the pixel (i,j) for the point (i,j), which is the
+		//pixel whose centre is at (i+0.5, j+0.5) for SDL_RenderGeometry
+		v.position.x = x + 0.5f;
+		v.position.y = y + 0.5f;
+		v.color = c;
+		v.tex_coord.x = v.tex_coord.y = 0;
+		batch_vertices.push_back(v);
+	}
+#endif
+	//Draw everything in the batch
+	void flushBatch(){
+#if TR_HAVE_GEOMETRY
+		if (batch_indices.empty())
+			return;
+		SDL_RenderGeometry(renderer, NULL, &batch_vertices[0], batch_vertices.size(), &batch_indices[0], batch_indices.size());
+		batch_vertices.clear();
+		batch_indices.clear();
+#endif
+	}
+	//Add the given triangles (indices into vx/vy) to the batch
+	void batchTriangles(const float* vx, const float* vy, int n, const int* triangles, int num_indices, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+#if TR_HAVE_GEOMETRY
+		scratch.resize(2*n);
+		float* tx = &scratch[0];
+		float* ty = tx + n;
+		transform.TransformPoints(vx, vy, tx, ty, n);
+		if (rejectBatched(tx, ty, n))
+			return;
+		SDL_Color c = {r, g, b, a};
+		int base = batch_vertices.size();
+		for (int i = 0; i < n; i++)
+			batchVertex(tx[i], ty[i], c);
+		for (int i = 0; i < num_indices; i++)
+			batch_indices.push_back(base + triangles[i]);
+		if ((int)batch_vertices.size() >= BATCH_FLUSH_VERTICES)
+			flushBatch();
+#endif
+	}
+	//Add the closed outline of a polygon to the batch, one quad per edge
+	void batchOutline(const float* vx, const float* vy, int n, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+#if TR_HAVE_GEOMETRY
+		scratch.resize(2*n);
+		float* tx = &scratch[0];
+		float* ty = tx + n;
+		transform.TransformPoints(vx, vy, tx, ty, n);
+		if (rejectBatched(tx, ty, n))
+			return;
+		SDL_Color c = {r, g, b, a};
+		for (int i = 0; i < n; i++){
+			int j = (i + 1) % n;
+			float dx = tx[j] - tx[i], dy = ty[j] - ty[i];
+			float len = sqrtf(dx*dx + dy*dy);
+			if (len < 1e-6f){
+				dx = 0.5f; dy = 0;
+			}else{
+				dx *= 0.5f/len; dy *= 0.5f/len;
+			}
+			//Half a pixel on each side, extended by half a pixel at each end
+			int base = batch_vertices.size();
+			batchVertex(tx[i] - dx - dy, ty[i] - dy + dx, c);
+			batchVertex(tx[j] + dx - dy, ty[j] + dy + dx, c);
+			batchVertex(tx[j] + dx + dy, ty[j] + dy - dx, c);
+			batchVertex(tx[i] - dx + dy, ty[i] - dy - dx, c);
+			static const int quad[] = {0,1,2, 0,2,3};
+			for (int k = 0; k < 6; k++)
+				batch_indices.push_back(base + quad[k]);
+		}
+		if ((int)batch_vertices.size() >= BATCH_FLUSH_VERTICES)
+			flushBatch();
+#endif
 	}
 	
 	SDL_Renderer* renderer;
-	Matrix3 transform;
+	Affine2 transform;
+	bool batching;
+	Backend backend;
+	SoftwareRasterizer raster;
+	bool software_dirty; //Drawn to since the last upload
+	SDL_Texture* texture; //Streaming texture for the software backend
+	TiledRasterizer* tiled; //Created the first time BACKEND_TILED is selected
+	int view_w, view_h; //Size of the render target
+	ClipStats clip_stats;
+	//Buffers for clipping (kept between calls)
+	std::vector<double> clip_x, clip_y, clip_a, clip_b;
+	std::vector<Sint16> clip_ix, clip_iy;
+	std::vector<Shape> shapes;
+	int circle_shape;
+#if TR_HAVE_GEOMETRY
+	//The batch waiting for flushBatch, and room for the transformed points
+	//of the shape being added to it
+	std::vector<SDL_Vertex> batch_vertices;
+	std::vector<int> batch_indices;
+	std::vector<float> scratch;
+#endif
 };
 
 
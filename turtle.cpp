@@ -0,0 +1,759 @@
+/* turtle.cpp
+
+   Turtle interpretation of L-system strings into retained geometry.
+*/
+#include <cstdio>
+#include <stack>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include "turtle.h"
+#include "parallel.h"
+#include "LSystem.h"
+
+TurtleInterpreter::TurtleInterpreter(){
+	SetStem(1, 6);
+	SetAction('[', TURTLE_ACTION_PUSH);
+	SetAction(']', TURTLE_ACTION_POP);
+	SetAction('L', TURTLE_ACTION_DRAW, Affine2d(), TURTLE_LEAF);
+	SetAction('T', TURTLE_ACTION_DRAW, Affine2d(), TURTLE_STEM);
+	SetAngle(M_PI/6);
+	SetScale(0.9);
+	float vx[] = {0,1.0 ,1.25,   1,  0,  -1,-1.25,-1};
+	float vy[] = {0,0.75,1.75,2.75,4.0,2.75, 1.75,0.75};
+	SetShape(TURTLE_LEAF, vx, vy, 8);
+}
+
+void TurtleInterpreter::SetAction(char c, int type, const Affine2d& delta, int primitive){
+	TurtleAction& a = actions[(unsigned char)c];
+	a.type = type;
+	a.delta = delta;
+	a.primitive = primitive;
+	if (type == TURTLE_ACTION_DRAW && primitive == TURTLE_STEM)
+		a.delta = Affine2d::Translation(0, stem_length);
+}
+
+void TurtleInterpreter::SetStem(double width, double length){
+	stem_width = width;
+	stem_length = length;
+	float vx[] = {float(-width/2), float(width/2), float(width/2), float(-width/2)};
+	float vy[] = {0, 0, float(length), float(length)};
+	SetShape(TURTLE_STEM, vx, vy, 4);
+	for(int c = 0; c < 256; c++)
+		if (actions[c].type == TURTLE_ACTION_DRAW && actions[c].primitive == TURTLE_STEM)
+			actions[c].delta = Affine2d::Translation(0, stem_length);
+}
+
+//(Built directly rather than with Affine2d::Rotation so that '-' is
+//exactly the inverse of '+')
+static Affine2d RotationCS(double c, double s){
+	return Affine2d(c, s, 0, -s, c, 0);
+}
+
+void TurtleInterpreter::SetAngle(double radians){
+	double c = cos(radians), s = sin(radians);
+	SetAction('+', TURTLE_ACTION_MOVE, RotationCS(c, s));
+	SetAction('-', TURTLE_ACTION_MOVE, RotationCS(c, -s));
+}
+
+void TurtleInterpreter::SetScale(double factor){
+	SetAction('s', TURTLE_ACTION_MOVE, Affine2d::Scale(factor, factor));
+	SetAction('S', TURTLE_ACTION_MOVE, Affine2d::Scale(1/factor, 1/factor));
+	SetAction('h', TURTLE_ACTION_MOVE, Affine2d::Scale(factor, 1));
+	SetAction('H', TURTLE_ACTION_MOVE, Affine2d::Scale(1/factor, 1));
+	SetAction('v', TURTLE_ACTION_MOVE, Affine2d::Scale(1, factor));
+	SetAction('V', TURTLE_ACTION_MOVE, Affine2d::Scale(1, 1/factor));
+}
+
+bool TurtleInterpreter::Configure(const vector<string>& directives, string& error){
+	for(unsigned int i = 0; i < directives.size(); i++){
+		istringstream in(directives[i]);
+		string name;
+		in >> name;
+		bool valid = true;
+		if (name == "angle"){
+			double degrees;
+			valid = bool(in >> degrees);
+			if (valid)
+				SetAngle(degrees*M_PI/180);
+		}else if (name == "scale"){
+			double factor;
+			valid = (in >> factor) && factor != 0;
+			if (valid)
+				SetScale(factor);
+		}else if (name == "step" || name == "width"){
+			double v;
+			valid = bool(in >> v);
+			if (valid)
+				SetStem(name == "width"? v: stem_width, name == "step"? v: stem_length);
+		}else if (name == "leaf"){
+			vector<float> vx, vy;
+			string point;
+			float x, y;
+			while (in >> point){
+				if (sscanf(point.c_str(), "%f,%f", &x, &y) != 2){
+					valid = false;
+					break;
+				}
+				vx.push_back(x);
+				vy.push_back(y);
+			}
+			valid = valid && vx.size() >= 3;
+			if (valid)
+				SetShape(TURTLE_LEAF, &vx[0], &vy[0], vx.size());
+		}else if (name == "symbol"){
+			string symbol, action;
+			double a = 0, b = 0;
+			if (!(in >> symbol >> action) || symbol.size() != 1)
+				valid = false;
+			else if (action == "rotate"){
+				valid = bool(in >> a);
+				if (valid)
+					SetAction(symbol[0], TURTLE_ACTION_MOVE, RotationCS(cos(a*M_PI/180), sin(a*M_PI/180)));
+			}else if (action == "scale"){
+				valid = bool(in >> a);
+				if (valid && !(in >> b))
+					b = a;
+				valid = valid && a != 0 && b != 0;
+				if (valid)
+					SetAction(symbol[0], TURTLE_ACTION_MOVE, Affine2d::Scale(a, b));
+			}else if (action == "move"){
+				valid = bool(in >> a >> b);
+				if (valid)
+					SetAction(symbol[0], TURTLE_ACTION_MOVE, Affine2d::Translation(a, b));
+			}else if (action == "leaf")
+				SetAction(symbol[0], TURTLE_ACTION_DRAW, Affine2d(), TURTLE_LEAF);
+			else if (action == "stem")
+				SetAction(symbol[0], TURTLE_ACTION_DRAW, Affine2d(), TURTLE_STEM);
+			else if (action == "push")
+				SetAction(symbol[0], TURTLE_ACTION_PUSH);
+			else if (action == "pop")
+				SetAction(symbol[0], TURTLE_ACTION_POP);
+			else if (action == "ignore")
+				SetAction(symbol[0], TURTLE_ACTION_NONE);
+			else
+				valid = false;
+		}else
+			valid = false;
+		if (!valid){
+			error = "@" + directives[i];
+			return false;
+		}
+	}
+	return true;
+}
+
+void TurtleInterpreter::GetShape(int type, vector<float>& vx, vector<float>& vy) const{
+	vx.resize(shape_points[type].size());
+	vy.resize(shape_points[type].size());
+	for(unsigned int i = 0; i < shape_points[type].size(); i++){
+		vx[i] = shape_points[type][i].x;
+		vy[i] = shape_points[type][i].y;
+	}
+}
+
+void TurtleInterpreter::SetShape(int type, const float* vx, const float* vy, int n){
+	shape_points[type].resize(n);
+	shape_bounds[type] = TurtleBounds();
+	for(int i = 0; i < n; i++){
+		shape_points[type][i].x = vx[i];
+		shape_points[type][i].y = vy[i];
+		shape_bounds[type].add(TurtleBounds(vx[i], vy[i], vx[i], vy[i]));
+	}
+}
+
+void TurtleInterpreter::Compile(const string& s, const LSystem* L, vector<TurtleAction>& out) const{
+	out.clear();
+	for(unsigned int j = 0; j < s.size(); j++){
+		if (L && L->HasRule(s[j])){
+			TurtleAction symbol;
+			symbol.type = TURTLE_ACTION_SYMBOL;
+			symbol.symbol = s[j];
+			out.push_back(symbol);
+			continue;
+		}
+		const TurtleAction& action = actions[(unsigned char)s[j]];
+		if (action.type == TURTLE_ACTION_NONE)
+			continue;
+		//Compose a move with the move (or draw) before it
+		if (action.type == TURTLE_ACTION_MOVE && !out.empty()
+				&& (out.back().type == TURTLE_ACTION_MOVE || out.back().type == TURTLE_ACTION_DRAW)){
+			out.back().delta = out.back().delta*action.delta;
+			continue;
+		}
+		out.push_back(action);
+	}
+}
+
+void TurtleInterpreter::Compile(const LSystem& L, TurtleProgram& out) const{
+	out.system = &L;
+	Compile(L.GetAxiom(), &L, out.axiom);
+	out.symbols = L.GetAxiom().size();
+	out.actions = out.axiom.size();
+	out.substitutions.clear();
+	vector<const string*> substitutions;
+	L.GetSubstitutions(substitutions);
+	for(unsigned int i = 0; i < substitutions.size(); i++){
+		vector<TurtleAction>& compiled = out.substitutions[substitutions[i]];
+		Compile(*substitutions[i], &L, compiled);
+		out.symbols += substitutions[i]->size();
+		out.actions += compiled.size();
+	}
+}
+
+bool TurtleInterpreter::Generate(const TurtleProgram& program, int iterations, vector<TurtleAction>& out, const TurtleCancel* cancel) const{
+	out.clear();
+	return GenerateRecursive(program, program.axiom, 0, iterations, out, cancel);
+}
+
+//(The same expansion as LSystem::GenerateRecursive, on compiled strings)
+bool TurtleInterpreter::GenerateRecursive(const TurtleProgram& program, const vector<TurtleAction>& ops, int iteration, int iterations, vector<TurtleAction>& out, const TurtleCancel* cancel) const{
+	for(unsigned int j = 0; j < ops.size(); j++){
+		if (ops[j].type != TURTLE_ACTION_SYMBOL){
+			out.push_back(ops[j]);
+			continue;
+		}
+		const string* substitution = program.system->GetSubstitution(ops[j].symbol, iteration, iterations);
+		if (substitution){
+			//(Checked once per expansion: a relaxed load is cheap next to the copying)
+			if (cancel && cancel->cancelled())
+				return false;
+			if (!GenerateRecursive(program, program.Substitution(substitution), iteration + 1, iterations, out, cancel))
+				return false;
+		}else if (actions[ops[j].symbol].type != TURTLE_ACTION_NONE)
+			out.push_back(actions[ops[j].symbol]);
+	}
+	return true;
+}
+
+//True if the move does nothing (up to rounding far below a pixel at any
+//sensible scale, so "+-" and "sS" cancel)
+static bool IsIdentity(const Affine2d& T){
+	const double e = 1e-12;
+	return fabs(T.m00 - 1) < e && fabs(T.m01) < e && fabs(T.m02) < e
+		&& fabs(T.m10) < e && fabs(T.m11 - 1) < e && fabs(T.m12) < e;
+}
+
+TurtlePeepholeStats TurtleInterpreter::Optimize(vector<TurtleAction>& ops){
+	TurtlePeepholeStats stats;
+	stats.before = ops.size();
+	//The actions kept so far are ops[0, w). For each open branch, the
+	//index of its '[' in the output and the number of draws before it.
+	unsigned int w = 0;
+	unsigned long draws = 0;
+	vector<unsigned int> open;
+	vector<unsigned long> open_draws;
+	for(unsigned int r = 0; r < ops.size(); r++){
+		const TurtleAction& action = ops[r];
+		switch(action.type){
+			case TURTLE_ACTION_MOVE:
+				if (w > 0 && (ops[w-1].type == TURTLE_ACTION_MOVE || ops[w-1].type == TURTLE_ACTION_DRAW)){
+					ops[w-1].delta = ops[w-1].delta*action.delta;
+					stats.merged++;
+					if (ops[w-1].type == TURTLE_ACTION_MOVE && IsIdentity(ops[w-1].delta)){
+						w--;
+						stats.cancelled++;
+					}
+				}else if (IsIdentity(action.delta))
+					stats.cancelled++;
+				else
+					ops[w++] = action;
+				break;
+			case TURTLE_ACTION_DRAW:
+				draws++;
+				ops[w++] = action;
+				break;
+			case TURTLE_ACTION_PUSH:
+				open.push_back(w);
+				open_draws.push_back(draws);
+				ops[w++] = action;
+				break;
+			case TURTLE_ACTION_POP:
+				//(An unbalanced ']' is ignored by the interpreter)
+				if (open.empty())
+					break;
+				if (w > 0 && ops[w-1].type == TURTLE_ACTION_MOVE){
+					w--;
+					stats.dead++;
+				}
+				if (draws == open_draws.back()){
+					w = open.back();
+					stats.empty_branches++;
+				}else
+					ops[w++] = action;
+				open.pop_back();
+				open_draws.pop_back();
+				break;
+			case TURTLE_ACTION_NONE:
+				break;
+			default:
+				ops[w++] = action;
+				break;
+		}
+	}
+	if (w > 0 && ops[w-1].type == TURTLE_ACTION_MOVE){
+		w--;
+		stats.dead++;
+	}
+	ops.resize(w);
+	stats.after = w;
+	return stats;
+}
+
+void TurtleInterpreter::Interpret(const string& s, TurtleGeometry& out) const{
+	vector<TurtleAction> ops;
+	Compile(s, NULL, ops);
+	Interpret(ops, out);
+}
+
+bool TurtleInterpreter::Interpret(const vector<TurtleAction>& ops, TurtleGeometry& out, const TurtleCancel* cancel) const{
+	out.clear();
+	out.symbols = ops.size();
+	//The turtle state is kept in double precision: deep trees compose
+	//thousands of transforms and float error visibly accumulates
+	stack<Affine2d> t_stack;
+	//Indices of the branches that are open (the bounds of each primitive
+	//are added to the innermost one, and merged into its parent when it
+	//is closed)
+	stack<unsigned int> open;
+	Affine2d transform;
+	TurtlePrimitive p;
+	for(unsigned int j = 0; j < ops.size(); j++){
+		if (cancel && j % TurtleCancel::CHECK_INTERVAL == TurtleCancel::CHECK_INTERVAL - 1 && cancel->cancelled())
+			return false;
+		const TurtleAction& action = ops[j];
+		switch(action.type){
+			case TURTLE_ACTION_DRAW:
+				p.transform = Affine2(transform);
+				p.type = action.primitive;
+				out.primitives.push_back(p);
+				if (p.type == TURTLE_LEAF)
+					out.leaves++;
+				if (!open.empty()){
+					TurtleBranch& b = out.branches[open.top()];
+					b.bounds.add(shape_bounds[p.type].transformed(transform));
+					if (p.type == TURTLE_LEAF)
+						b.leaves++;
+				}else
+					out.bounds.add(shape_bounds[p.type].transformed(transform));
+				transform = transform*action.delta;
+				break;
+			case TURTLE_ACTION_MOVE:
+				transform = transform*action.delta;
+				break;
+			case TURTLE_ACTION_PUSH:{
+				t_stack.push(transform);
+				TurtleBranch b;
+				b.first = b.end = out.primitives.size();
+				b.next = b.leaves = 0;
+				open.push(out.branches.size());
+				out.branches.push_back(b);
+				break;
+			}
+			case TURTLE_ACTION_POP:
+				//Unbalanced brackets are ignored rather than popping an empty stack
+				if (!t_stack.empty()){
+					transform = t_stack.top();
+					t_stack.pop();
+					CloseBranch(out, open);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	while (!open.empty())
+		CloseBranch(out, open);
+	return true;
+}
+
+void TurtleInterpreter::CloseBranch(TurtleGeometry& out, stack<unsigned int>& open){
+	TurtleBranch& b = out.branches[open.top()];
+	open.pop();
+	b.end = out.primitives.size();
+	b.next = out.branches.size();
+	if (!open.empty()){
+		out.branches[open.top()].bounds.add(b.bounds);
+		out.branches[open.top()].leaves += b.leaves;
+	}else
+		out.bounds.add(b.bounds);
+}
+
+bool TurtleInterpreter::Interpret(const vector<TurtleAction>& ops, TurtleGeometry& out, int threads, const TurtleCancel* cancel) const{
+	//Chunks smaller than this aren't worth a thread
+	const unsigned int MIN_CHUNK = 4096;
+	if (threads <= 0)
+		threads = max(1u, thread::hardware_concurrency());
+	unsigned int n = min((unsigned long)threads*4, (unsigned long)(ops.size()/MIN_CHUNK));
+	if (threads == 1 || n <= 1)
+		return Interpret(ops, out, cancel);
+	//Affine composition is associative, so the turtle's state at the start
+	//of each chunk could be found by a prefix scan of the chunks' net
+	//transforms, but regrouping the products changes their rounding. To
+	//stay bit-identical the state is found by composing the same products
+	//in the same order, only skipping the branches which close within a
+	//chunk (their ']' restores the transform saved at their '['). That only
+	//visits the path from the root to each chunk, so the work left serial
+	//is small for bushy trees; the scans that are done in parallel are
+	//over counts, which are exact.
+	vector<Chunk> chunks(n);
+	const unsigned int NO_MATCH = (unsigned int)-1;
+	vector<unsigned int> match(ops.size()); //For each '[', its ']' in the same chunk (or NO_MATCH)
+	for (unsigned int i = 0; i < n; i++){
+		chunks[i].begin = (unsigned long)ops.size()*i/n;
+		chunks[i].end = (unsigned long)ops.size()*(i + 1)/n;
+	}
+	//Count the primitives and branches in each chunk and match its brackets
+	ParallelFor(n, threads, [&](int i){
+		Chunk& c = chunks[i];
+		c.primitives = c.branches = c.leaves = 0;
+		vector<unsigned int> pushes;
+		for (unsigned int j = c.begin; j < c.end; j++){
+			if (ops[j].type == TURTLE_ACTION_DRAW){
+				c.primitives++;
+				if (ops[j].primitive == TURTLE_LEAF)
+					c.leaves++;
+			}
+			else if (ops[j].type == TURTLE_ACTION_PUSH){
+				match[j] = NO_MATCH;
+				c.unmatched.push_back(make_pair(j, c.branches++));
+				pushes.push_back(c.unmatched.size() - 1);
+			}else if (ops[j].type == TURTLE_ACTION_POP && !pushes.empty()){
+				match[c.unmatched[pushes.back()].first] = j;
+				c.unmatched[pushes.back()].first = NO_MATCH;
+				pushes.pop_back();
+			}
+		}
+		unsigned int k = 0;
+		for (unsigned int u = 0; u < c.unmatched.size(); u++)
+			if (c.unmatched[u].first != NO_MATCH)
+				c.unmatched[k++] = c.unmatched[u];
+		c.unmatched.resize(k);
+	});
+	//Place each chunk's output and find the state at its start
+	unsigned int primitives = 0, branches = 0;
+	Affine2d transform;
+	vector<Affine2d> saved;
+	vector<unsigned int> open;
+	for (unsigned int i = 0; i < n; i++){
+		Chunk& c = chunks[i];
+		//(Chunks are at least MIN_CHUNK actions, so once per chunk is often enough)
+		if (cancel && cancel->cancelled())
+			return false;
+		c.transform = transform;
+		c.saved = saved;
+		c.open = open;
+		unsigned int u = 0;
+		for (unsigned int j = c.begin; j < c.end; j++){
+			const TurtleAction& action = ops[j];
+			switch(action.type){
+				case TURTLE_ACTION_DRAW:
+				case TURTLE_ACTION_MOVE:
+					transform = transform*action.delta;
+					break;
+				case TURTLE_ACTION_PUSH:
+					if (match[j] != NO_MATCH)
+						j = match[j];
+					else{
+						saved.push_back(transform);
+						open.push_back(branches + c.unmatched[u++].second);
+					}
+					break;
+				case TURTLE_ACTION_POP:
+					if (!saved.empty()){
+						transform = saved.back();
+						saved.pop_back();
+						open.pop_back();
+					}
+					break;
+				default:
+					break;
+			}
+		}
+		unsigned int p = c.primitives, b = c.branches;
+		c.primitives = primitives;
+		c.branches = branches;
+		primitives += p;
+		branches += b;
+	}
+	out.clear();
+	out.symbols = ops.size();
+	out.primitives.resize(primitives);
+	out.branches.resize(branches);
+	ParallelFor(n, threads, [&](int i){
+		InterpretChunk(ops, chunks[i], out, cancel);
+	});
+	if (cancel && cancel->cancelled())
+		return false;
+	//Finish the branches which spanned chunks
+	for (unsigned int i = 0; i < n; i++){
+		Chunk& c = chunks[i];
+		for (unsigned int k = 0; k < c.closed.size(); k += 3){
+			out.branches[c.closed[k]].end = c.closed[k + 1];
+			out.branches[c.closed[k]].next = c.closed[k + 2];
+		}
+		//(What was drawn inside a branch was also drawn inside its parents)
+		for (int d = (int)c.open.size() - 1; d >= 0; d--){
+			if (d > 0){
+				c.inherited_bounds[d - 1].add(c.inherited_bounds[d]);
+				c.inherited_leaves[d - 1] += c.inherited_leaves[d];
+			}
+			out.branches[c.open[d]].bounds.add(c.inherited_bounds[d]);
+			out.branches[c.open[d]].leaves += c.inherited_leaves[d];
+		}
+		out.bounds.add(c.bounds);
+		out.leaves += c.leaves;
+	}
+	return true;
+}
+
+//(If the job is cancelled this stops early and leaves the chunk unfinished;
+//Interpret notices afterwards)
+void TurtleInterpreter::InterpretChunk(const vector<TurtleAction>& ops, Chunk& c, TurtleGeometry& out, const TurtleCancel* cancel) const{
+	//Branches still open at the end of the whole string end with it
+	unsigned int last_primitive = out.primitives.size(), last_branch = out.branches.size();
+	unsigned int inherited = c.open.size(); //Of the open branches, how many are inherited
+	c.inherited_bounds.resize(inherited);
+	c.inherited_leaves.assign(inherited, 0);
+	vector<Affine2d> t_stack = c.saved;
+	vector<unsigned int> open = c.open;
+	Affine2d transform = c.transform;
+	unsigned int primitive = c.primitives, branch = c.branches;
+	//Add bounds and leaves to the innermost open branch
+	auto add = [&](const TurtleBounds& bounds, unsigned int leaves){
+		if (open.size() > inherited){
+			out.branches[open.back()].bounds.add(bounds);
+			out.branches[open.back()].leaves += leaves;
+		}else if (inherited > 0){
+			c.inherited_bounds[inherited - 1].add(bounds);
+			c.inherited_leaves[inherited - 1] += leaves;
+		}
+	};
+	for(unsigned int j = c.begin; j < c.end; j++){
+		if (cancel && (j - c.begin) % TurtleCancel::CHECK_INTERVAL == TurtleCancel::CHECK_INTERVAL - 1 && cancel->cancelled())
+			return;
+		const TurtleAction& action = ops[j];
+		switch(action.type){
+			case TURTLE_ACTION_DRAW:{
+				TurtlePrimitive& p = out.primitives[primitive++];
+				p.transform = Affine2(transform);
+				p.type = action.primitive;
+				TurtleBounds bounds = shape_bounds[p.type].transformed(transform);
+				c.bounds.add(bounds);
+				add(bounds, p.type == TURTLE_LEAF? 1: 0);
+				transform = transform*action.delta;
+				break;
+			}
+			case TURTLE_ACTION_MOVE:
+				transform = transform*action.delta;
+				break;
+			case TURTLE_ACTION_PUSH:{
+				t_stack.push_back(transform);
+				TurtleBranch& b = out.branches[branch];
+				b.first = primitive;
+				b.end = last_primitive;
+				b.next = last_branch;
+				b.leaves = 0;
+				b.bounds = TurtleBounds();
+				open.push_back(branch++);
+				break;
+			}
+			case TURTLE_ACTION_POP:
+				if (!t_stack.empty()){
+					transform = t_stack.back();
+					t_stack.pop_back();
+					if (open.size() > inherited){
+						TurtleBranch& b = out.branches[open.back()];
+						b.end = primitive;
+						b.next = branch;
+						open.pop_back();
+						add(b.bounds, b.leaves);
+					}else{
+						c.closed.push_back(open.back());
+						c.closed.push_back(primitive);
+						c.closed.push_back(branch);
+						open.pop_back();
+						inherited--;
+					}
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	//The chunk's own branches which are still open carry on into the next
+	//chunk, which adds what it draws in them; pass on what this one drew
+	while (open.size() > inherited){
+		const TurtleBranch& b = out.branches[open.back()];
+		open.pop_back();
+		add(b.bounds, b.leaves);
+	}
+}
+
+bool TurtleInterpreter::ExpandedBounds(const TurtleProgram& program, int iterations, TurtleBounds& out, const TurtleCancel* cancel) const{
+	//The expansion of a symbol depends only on the iteration it is reached
+	//at (for a fixed total), so each (symbol, iteration) is summarised
+	//once, from the summaries of the symbols in its substitution
+	ExpansionTable table(max(iterations, 0), vector<Expansion>(256));
+	vector<Point> hull;
+	Affine2d net;
+	if (!Summarise(program, program.axiom, 0, iterations, table, true, hull, net, cancel))
+		return false;
+	out = TurtleBounds();
+	for(unsigned int i = 0; i < hull.size(); i++)
+		out.add(TurtleBounds(hull[i].x, hull[i].y, hull[i].x, hull[i].y));
+	return true;
+}
+
+bool TurtleInterpreter::Instance(const TurtleProgram& program, int iterations, TurtleInstances& out, const TurtleCancel* cancel) const{
+	out.clear();
+	ExpansionTable table(max(iterations, 0), vector<Expansion>(256));
+	vector<Point> hull;
+	Affine2d net;
+	TurtleInstance root;
+	if (!Summarise(program, program.axiom, 0, iterations, table, true, hull, net, cancel, &out, &root)){
+		out.clear();
+		return false;
+	}
+	out.root = out.instances.size();
+	out.instances.push_back(root);
+	return true;
+}
+
+bool TurtleInterpreter::Summarise(const TurtleProgram& program, const vector<TurtleAction>& ops, int iteration, int iterations, ExpansionTable& table, bool top_level,
+		vector<Point>& hull, Affine2d& net, const TurtleCancel* cancel, TurtleInstances* instances, TurtleInstance* inst) const{
+	vector<Point> points;
+	stack<Affine2d> t_stack;
+	Affine2d transform;
+	TurtleInstanceItem item;
+	if (inst){
+		inst->items.clear();
+		inst->primitives = inst->leaves = 0;
+	}
+	for(unsigned int j = 0; j < ops.size(); j++){
+		if (cancel && j % TurtleCancel::CHECK_INTERVAL == TurtleCancel::CHECK_INTERVAL - 1 && cancel->cancelled())
+			return false;
+		const TurtleAction* action = &ops[j];
+		const string* substitution = NULL;
+		if (action->type == TURTLE_ACTION_SYMBOL){
+			substitution = program.system->GetSubstitution(action->symbol, iteration, iterations);
+			//(A symbol which isn't replaced does what it usually does)
+			action = &actions[action->symbol];
+		}
+		if (substitution){
+			Expansion& e = table[iteration][ops[j].symbol];
+			if (e.state == Expansion::UNKNOWN){
+				//(Checked once per expansion, as in GenerateRecursive; a
+				//cancelled expansion comes back invalid, which ends the job)
+				if (cancel && cancel->cancelled())
+					return false;
+				TurtleInstance child;
+				bool valid = Summarise(program, program.Substitution(substitution), iteration + 1, iterations, table, false, e.hull, e.net, cancel, instances, instances? &child: NULL);
+				e.state = valid? Expansion::VALID: Expansion::INVALID;
+				if (valid && instances){
+					e.instance = instances->instances.size();
+					instances->instances.push_back(child);
+				}
+			}
+			if (e.state == Expansion::INVALID)
+				return false;
+			if (inst){
+				const TurtleInstance& child = instances->instances[e.instance];
+				//(Instances which draw nothing are left out)
+				if (child.primitives > 0){
+					item.transform = transform;
+					item.type = TURTLE_INSTANCE;
+					item.instance = e.instance;
+					inst->items.push_back(item);
+					inst->primitives += child.primitives;
+					inst->leaves += child.leaves;
+				}
+			}
+			for(unsigned int i = 0; i < e.hull.size(); i++){
+				Point p;
+				transform.Apply(e.hull[i].x, e.hull[i].y, p.x, p.y);
+				points.push_back(p);
+			}
+			transform = transform*e.net;
+		}else{
+			switch(action->type){
+				case TURTLE_ACTION_DRAW:{
+					int type = action->primitive;
+					const vector<Point>& shape = shape_points[type];
+					if (inst){
+						item.transform = transform;
+						item.type = type;
+						item.instance = -1;
+						inst->items.push_back(item);
+						inst->primitives++;
+						if (type == TURTLE_LEAF)
+							inst->leaves++;
+					}
+					for(unsigned int i = 0; i < shape.size(); i++){
+						Point p;
+						transform.Apply(shape[i].x, shape[i].y, p.x, p.y);
+						points.push_back(p);
+					}
+					transform = transform*action->delta;
+					break;
+				}
+				case TURTLE_ACTION_MOVE:
+					transform = transform*action->delta;
+					break;
+				case TURTLE_ACTION_PUSH:
+					t_stack.push(transform);
+					break;
+				case TURTLE_ACTION_POP:
+					if (!t_stack.empty()){
+						transform = t_stack.top();
+						t_stack.pop();
+					}else if (!top_level)
+						return false;
+					break;
+				default:
+					break;
+			}
+		}
+		//(Keep long substitutions from collecting too many points)
+		if (points.size() >= 4096)
+			ConvexHull(points);
+	}
+	if (!top_level && !t_stack.empty())
+		return false;
+	ConvexHull(points);
+	hull.swap(points);
+	net = transform;
+	if (inst){
+		inst->bounds = TurtleBounds();
+		for(unsigned int i = 0; i < hull.size(); i++)
+			inst->bounds.add(TurtleBounds(hull[i].x, hull[i].y, hull[i].x, hull[i].y));
+	}
+	return true;
+}
+
+//Replace points with their convex hull (Andrew's monotone chain), counterclockwise
+void TurtleInterpreter::ConvexHull(vector<Point>& points){
+	if (points.size() < 3)
+		return;
+	sort(points.begin(), points.end(), [](const Point& a, const Point& b){
+		return a.x < b.x || (a.x == b.x && a.y < b.y);
+	});
+	//Positive if a, b, c turn counterclockwise
+	auto turn = [](const Point& a, const Point& b, const Point& c){
+		return (b.x - a.x)*(c.y - a.y) - (b.y - a.y)*(c.x - a.x);
+	};
+	int n = points.size(), k = 0;
+	vector<Point> hull(2*n);
+	for(int i = 0; i < n; i++){
+		while (k >= 2 && turn(hull[k-2], hull[k-1], points[i]) <= 0)
+			k--;
+		hull[k++] = points[i];
+	}
+	for(int i = n - 2, lower = k + 1; i >= 0; i--){
+		while (k >= lower && turn(hull[k-2], hull[k-1], points[i]) <= 0)
+			k--;
+		hull[k++] = points[i];
+	}
+	hull.resize(k - 1);
+	points.swap(hull);
+}
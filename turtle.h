@@ -0,0 +1,300 @@
+/* turtle.h
+
+   Turtle interpretation of L-system strings into retained geometry.
+   The interpreter works in tree-local coordinates (the root of the tree
+   at the origin, growing along +y) and knows nothing about the window,
+   so its output can be cached and redrawn under any view transform.
+
+   The meaning of each symbol comes from a table of actions, set up with
+   the usual meanings and changed by the directives in the grammar file
+   (lines starting with '@'):
+     @angle <degrees>    rotation of '+' (counterclockwise) and '-' (default 30)
+     @scale <factor>     scale of s, h and v (S, H and V undo it) (default 0.9)
+     @step <length>      stem length, which the turtle moves after each T (default 6)
+     @width <width>      stem width (default 1)
+     @leaf x,y x,y ...   the leaf outline (convex, with the leaf's base at 0,0)
+     @symbol <c> <action>
+                         give the symbol c one of the actions rotate <degrees>,
+                         scale <sx> [sy], move <dx> <dy>, leaf, stem, push,
+                         pop or ignore
+*/
+#ifndef TURTLE_H
+#define TURTLE_H
+#include <string>
+#include <stack>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <map>
+#include <atomic>
+#include "matrix.h"
+#include "LSystem.h"
+
+using namespace std;
+
+enum TurtlePrimitiveType{
+	TURTLE_LEAF = 0,
+	TURTLE_STEM = 1,
+	TURTLE_INSTANCE = 2, //(Only in a TurtleInstance)
+};
+
+//One leaf or stem, with the turtle transform that was current when it was drawn
+struct TurtlePrimitive{
+	Affine2 transform;
+	int type;
+};
+
+//An axis aligned bounding box (empty when x0 > x1)
+struct TurtleBounds{
+	float x0, y0, x1, y1;
+	TurtleBounds(): x0(1), y0(1), x1(0), y1(0){ }
+	TurtleBounds(float x0, float y0, float x1, float y1): x0(x0), y0(y0), x1(x1), y1(y1){ }
+	bool empty() const{ return x0 > x1; }
+	void add(const TurtleBounds& b){
+		if (b.empty())
+			return;
+		if (empty()){
+			*this = b;
+			return;
+		}
+		x0 = min(x0, b.x0); y0 = min(y0, b.y0);
+		x1 = max(x1, b.x1); y1 = max(y1, b.y1);
+	}
+	//The bounding box of this box after the transform T
+	TurtleBounds transformed(const Affine2d& T) const{
+		if (empty())
+			return *this;
+		double cx = (x0 + x1)/2.0, cy = (y0 + y1)/2.0;
+		double ex = (x1 - x0)/2.0, ey = (y1 - y0)/2.0;
+		double tx, ty;
+		T.Apply(cx, cy, tx, ty);
+		double rx = fabs(T.m00)*ex + fabs(T.m01)*ey;
+		double ry = fabs(T.m10)*ex + fabs(T.m11)*ey;
+		return TurtleBounds(tx - rx, ty - ry, tx + rx, ty + ry);
+	}
+};
+
+//The primitives drawn between a '[' and its matching ']'. Branches are
+//stored in the order of their '[', so a branch's sub-branches follow it
+//directly; skipping a branch means continuing from primitive end and
+//branch record next.
+struct TurtleBranch{
+	unsigned int first, end; //Primitives [first, end)
+	unsigned int next; //Index of the first branch record after this branch
+	unsigned int leaves; //Number of the primitives which are leaves
+	TurtleBounds bounds; //Of every primitive in the branch (tree-local)
+};
+
+struct TurtleGeometry{
+	vector<TurtlePrimitive> primitives;
+	vector<TurtleBranch> branches;
+	TurtleBounds bounds; //Of the whole tree (tree-local)
+	unsigned long leaves; //Number of the primitives which are leaves
+	unsigned long symbols; //Number of actions interpreted
+	TurtleGeometry(): leaves(0), symbols(0){ }
+	void clear(){
+		primitives.clear();
+		branches.clear();
+		bounds = TurtleBounds();
+		leaves = 0;
+		symbols = 0;
+	}
+};
+
+enum TurtleActionType{
+	TURTLE_ACTION_NONE, //The symbol is ignored
+	TURTLE_ACTION_MOVE, //Compose the turtle's transform with delta
+	TURTLE_ACTION_DRAW, //Draw a primitive, then compose with delta
+	TURTLE_ACTION_PUSH, //Save the turtle's transform ('[')
+	TURTLE_ACTION_POP, //Restore it (']')
+	TURTLE_ACTION_SYMBOL, //(Only in a TurtleProgram) symbol, which a rule may replace
+};
+
+//What one symbol (or a compiled run of symbols) does, with its
+//transform precomputed
+struct TurtleAction{
+	int type; //TurtleActionType
+	int primitive; //TurtlePrimitiveType (for TURTLE_ACTION_DRAW)
+	unsigned char symbol; //For TURTLE_ACTION_SYMBOL
+	Affine2d delta;
+	TurtleAction(): type(TURTLE_ACTION_NONE), primitive(TURTLE_LEAF), symbol(0){ }
+};
+
+//Lets a long Generate, Interpret or Instance on one thread be abandoned
+//from another (the same token can cancel LSystem::GenerateSystemString)
+typedef GenerationCancel TurtleCancel;
+
+//What TurtleInterpreter::Optimize removed
+struct TurtlePeepholeStats{
+	unsigned long before, after; //Number of actions
+	unsigned long merged; //Moves composed into the action before them
+	unsigned long cancelled; //Moves which came to nothing (like "+-" or "sS")
+	unsigned long dead; //Moves with nothing drawn after them (before a ']' or the end)
+	unsigned long empty_branches; //Branches which drew nothing, removed with everything in them
+	TurtlePeepholeStats(): before(0), after(0), merged(0), cancelled(0), dead(0), empty_branches(0){ }
+};
+
+//An L-system's axiom and substitutions compiled into actions (see
+//TurtleInterpreter::Compile), valid while the LSystem exists
+struct TurtleProgram{
+	const LSystem* system;
+	vector<TurtleAction> axiom;
+	map<const string*, vector<TurtleAction> > substitutions; //Keyed by LSystem::GetSubstitution's result
+	unsigned long symbols, actions; //In the axiom and substitutions, before and after compiling
+	TurtleProgram(): system(NULL), symbols(0), actions(0){ }
+	const vector<TurtleAction>& Substitution(const string* s) const{
+		return substitutions.find(s)->second;
+	}
+};
+
+//One step of a TurtleInstance: a primitive, or another instance, drawn
+//under transform (relative to the instance's origin)
+struct TurtleInstanceItem{
+	Affine2d transform;
+	int type; //TurtlePrimitiveType
+	int instance; //Index in TurtleInstances::instances (for TURTLE_INSTANCE)
+};
+
+//The geometry drawn by expanding one symbol from one iteration. Every
+//occurrence of the symbol at that iteration draws the same thing under a
+//different transform, so it is stored once and referenced.
+struct TurtleInstance{
+	vector<TurtleInstanceItem> items;
+	TurtleBounds bounds; //Of everything the instance draws (instance-local)
+	unsigned long primitives, leaves; //Drawn by the instance, counting sub-instances
+};
+
+//Geometry for the whole string as a hierarchy of instances (the tree is
+//instances[root])
+struct TurtleInstances{
+	vector<TurtleInstance> instances;
+	int root; //-1 if empty
+	TurtleInstances(): root(-1){ }
+	void clear(){
+		instances.clear();
+		root = -1;
+	}
+};
+
+class TurtleInterpreter{
+public:
+	//Set up the default actions and shapes
+	TurtleInterpreter();
+
+	//Apply the directives from a grammar file (see the top of this file
+	//and LSystem::GetDirectives). Returns false and describes the problem
+	//in error if a directive is invalid (the ones before it still apply).
+	bool Configure(const vector<string>& directives, string& error);
+
+	//Compile the axiom and every substitution of L into actions. Each run
+	//of symbols which only move the turtle is composed into one
+	//TURTLE_ACTION_MOVE (or into the delta of the draw before it), and
+	//symbols which any rule of L replaces are kept as TURTLE_ACTION_SYMBOL.
+	void Compile(const LSystem& L, TurtleProgram& out) const;
+
+	//Replace the contents of out with the actions of the string the
+	//program's L-system generates for the given number of iterations (the
+	//compiled substitutions are copied in place of the symbols, so out
+	//contains no TURTLE_ACTION_SYMBOL). If cancel is given and the job is
+	//cancelled, returns false as soon as it notices (out is then incomplete).
+	bool Generate(const TurtleProgram& program, int iterations, vector<TurtleAction>& out, const TurtleCancel* cancel = NULL) const;
+
+	//Simplify generated actions without changing what they draw: compose
+	//each move into the move or draw before it, drop moves that cancel out
+	//or that nothing is drawn after, and drop branches which draw nothing
+	static TurtlePeepholeStats Optimize(vector<TurtleAction>& ops);
+
+	//Replace the contents of out with the primitives drawn by the actions.
+	//If cancel is given and the job is cancelled, returns false as soon as
+	//it notices (out is then incomplete).
+	bool Interpret(const vector<TurtleAction>& ops, TurtleGeometry& out, const TurtleCancel* cancel = NULL) const;
+	//The same, split into chunks which are interpreted by the given number
+	//of threads (0 for one per hardware thread). The output is identical
+	//to the single threaded Interpret, bit for bit.
+	bool Interpret(const vector<TurtleAction>& ops, TurtleGeometry& out, int threads, const TurtleCancel* cancel = NULL) const;
+	//Replace the contents of out with the primitives drawn by the string s
+	void Interpret(const string& s, TurtleGeometry& out) const;
+
+	//The outline of a primitive type in its own coordinates
+	void GetShape(int type, vector<float>& vx, vector<float>& vy) const;
+	const TurtleBounds& GetShapeBounds(int type) const{ return shape_bounds[type]; }
+	const TurtleAction& GetAction(char c) const{ return actions[(unsigned char)c]; }
+
+	//Find the bounding box (tree-local) of the primitives in the string L
+	//generates for the given number of iterations, without generating it.
+	//Returns false (leaving out unchanged) if a substitution that is used
+	//has unbalanced brackets, since its effect then depends on where it is,
+	//or if cancel is given and the job is cancelled.
+	bool ExpandedBounds(const TurtleProgram& program, int iterations, TurtleBounds& out, const TurtleCancel* cancel = NULL) const;
+
+	//Replace the contents of out with the geometry of the string L
+	//generates for the given number of iterations, built from the rules
+	//as instances without generating it (so the work and memory grow with
+	//the number of distinct (symbol, iteration) pairs, not the length of
+	//the string). Returns false in the same cases as ExpandedBounds (out is
+	//then empty).
+	bool Instance(const TurtleProgram& program, int iterations, TurtleInstances& out, const TurtleCancel* cancel = NULL) const;
+
+private:
+	struct Point{
+		double x, y;
+	};
+	//What drawing the expansion of one symbol does, relative to the
+	//turtle's state before it: the convex hull of the vertices drawn (which
+	//is exact under any further transform, unlike a box) and the turtle's
+	//transform afterwards
+	struct Expansion{
+		enum{ UNKNOWN, VALID, INVALID } state;
+		vector<Point> hull;
+		Affine2d net;
+		int instance; //Index in TurtleInstances::instances (when instancing)
+		Expansion(): state(UNKNOWN), instance(-1){ }
+	};
+	typedef vector<vector<Expansion> > ExpansionTable; //Indexed by iteration, then symbol
+	//A range of actions interpreted by one thread, and the turtle's state
+	//at its start. The branches which are open at the start (inherited)
+	//are finished after every chunk is done, from what the chunk recorded.
+	struct Chunk{
+		unsigned int begin, end; //Actions [begin, end)
+		unsigned int primitives, branches; //Drawn and opened before the chunk (counts within it until then)
+		unsigned int leaves; //Drawn in the chunk
+		vector<pair<unsigned int, unsigned int> > unmatched; //Each '[' with no ']' in the chunk, and its index among the chunk's branches
+		Affine2d transform;
+		vector<Affine2d> saved; //The transforms saved by the inherited branches
+		vector<unsigned int> open; //The inherited branches, outermost first
+		vector<TurtleBounds> inherited_bounds; //What the chunk drew inside each inherited branch (but not inside a deeper one)
+		vector<unsigned int> inherited_leaves;
+		vector<unsigned int> closed; //The inherited branches closed in the chunk, with their end and next (three per branch)
+		TurtleBounds bounds; //Of everything the chunk drew
+	};
+
+	//Compile s into out (if L is given, the symbols it has rules for are
+	//kept as TURTLE_ACTION_SYMBOL)
+	void Compile(const string& s, const LSystem* L, vector<TurtleAction>& out) const;
+	bool GenerateRecursive(const TurtleProgram& program, const vector<TurtleAction>& ops, int iteration, int iterations, vector<TurtleAction>& out, const TurtleCancel* cancel) const;
+	void SetShape(int type, const float* vx, const float* vy, int n);
+	//Set the stem's size (which also sets how far the stem actions move)
+	void SetStem(double width, double length);
+	void SetAction(char c, int type, const Affine2d& delta = Affine2d(), int primitive = TURTLE_LEAF);
+	//The actions of '+'/'-' and s/S/h/H/v/V
+	void SetAngle(double radians);
+	void SetScale(double factor);
+	static void CloseBranch(TurtleGeometry& out, stack<unsigned int>& open);
+	//Interpret one chunk into its place in out (see Interpret with threads)
+	void InterpretChunk(const vector<TurtleAction>& ops, Chunk& c, TurtleGeometry& out, const TurtleCancel* cancel) const;
+	//Summarise the compiled string ops, whose symbols are reached at the given
+	//iteration. Outside the top level the brackets must be balanced.
+	//If instances is given, the string's instance is also stored in inst
+	//(and those of the symbols it expands are added to instances).
+	//Returns false if the job is cancelled (if cancel is given).
+	bool Summarise(const TurtleProgram& program, const vector<TurtleAction>& ops, int iteration, int iterations, ExpansionTable& table, bool top_level,
+		vector<Point>& hull, Affine2d& net, const TurtleCancel* cancel, TurtleInstances* instances = NULL, TurtleInstance* inst = NULL) const;
+	static void ConvexHull(vector<Point>& points);
+	TurtleAction actions[256]; //Indexed by symbol
+	vector<Point> shape_points[2]; //Indexed by TurtlePrimitiveType
+	TurtleBounds shape_bounds[2];
+	double stem_width, stem_length;
+};
+
+#endif